@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "../../../../sop_mc.h"
 
 #define MAXLINE 4096
 #define DEFAULT_THREADCOUNT 10
@@ -14,16 +17,28 @@
   (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__),             \
    exit(EXIT_FAILURE))
 
-typedef unsigned int UINT;
+typedef struct progress {
+  pthread_mutex_t mutex;
+  uint64_t samples;
+  uint64_t hits;
+  double targetError; // 0 - every thread draws samplesCount points once
+} progress_t;
+
 typedef struct argsEstimation {
   pthread_t tid;
-  UINT seed;
+  rng4_t rng;
   int samplesCount;
+  progress_t *progress;
 } argsEstimation_t;
 
-void ReadArguments(int argc, char **argv, int *threadCount, int *samplesCount) {
+// zad1 [threadCount [samplesCount [targetError]]]
+// With targetError the threads keep drawing rounds of samplesCount points
+// until the standard error of the estimate drops below it.
+void ReadArguments(int argc, char **argv, int *threadCount, int *samplesCount,
+                   double *targetError) {
   *threadCount = DEFAULT_THREADCOUNT;
   *samplesCount = DEFAULT_SAMPLESIZE;
+  *targetError = 0.0;
 
   if (argc >= 2) {
     *threadCount = atoi(argv[1]);
@@ -39,37 +54,49 @@ void ReadArguments(int argc, char **argv, int *threadCount, int *samplesCount) {
       exit(EXIT_FAILURE);
     }
   }
+  if (argc >= 4) {
+    *targetError = atof(argv[3]);
+    if (*targetError <= 0.0) {
+      printf("Invalid value for 'targetError'\n");
+      exit(EXIT_FAILURE);
+    }
+  }
 }
 
 void *pi_estimation(void *voidPtr) {
   argsEstimation_t *args = voidPtr;
-  double *result;
-  if (NULL == (result = malloc(sizeof(double))))
-    ERR("malloc");
-
-  int insideCount = 0;
-  for (int i = 0; i < args->samplesCount; i++) {
-    double x = ((double)rand_r(&args->seed) / (double)RAND_MAX);
-    double y = ((double)rand_r(&args->seed) / (double)RAND_MAX);
-    if (sqrt(x * x + y * y) <= 1.0)
-      insideCount++;
+  progress_t *progress = args->progress;
+  int done = 0;
+  while (!done) {
+    uint64_t insideCount = mc_pi_hits(&args->rng, args->samplesCount);
+    pthread_mutex_lock(&progress->mutex);
+    progress->samples += args->samplesCount;
+    progress->hits += insideCount;
+    done = progress->targetError <= 0.0 ||
+           mc_pi_stderr(progress->hits, progress->samples) <=
+               progress->targetError;
+    pthread_mutex_unlock(&progress->mutex);
   }
-  *result = 4.0 * (double)insideCount / (double)args->samplesCount;
-  return result;
+  return NULL;
 }
 
 int main(int argc, char **argv) {
   int threadCount, samplesCount;
-  double *subresult;
-  ReadArguments(argc, argv, &threadCount, &samplesCount);
+  progress_t progress = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+  ReadArguments(argc, argv, &threadCount, &samplesCount,
+                &progress.targetError);
   argsEstimation_t *estimations =
       (argsEstimation_t *)malloc(sizeof(argsEstimation_t) * threadCount);
   if (estimations == NULL)
     ERR("Malloc error for estimation arguments!");
-  srand(time(NULL));
+  // every thread gets its own streams, jumped apart in the sequence of a
+  // single generator, so they never overlap
+  rng_t base;
+  rng_seed(&base, time(NULL));
   for (int i = 0; i < threadCount; i++) {
-    estimations[i].seed = rand();
+    rng4_init(&estimations[i].rng, &base);
     estimations[i].samplesCount = samplesCount;
+    estimations[i].progress = &progress;
   }
   for (int i = 0; i < threadCount; i++) {
     int err = pthread_create(&(estimations[i].tid), NULL, pi_estimation,
@@ -77,17 +104,15 @@ int main(int argc, char **argv) {
     if (err != 0)
       ERR("Couldn't create thread");
   }
-  double cumulativeResult = 0.0;
   for (int i = 0; i < threadCount; i++) {
-    int err = pthread_join(estimations[i].tid, (void *)&subresult);
+    int err = pthread_join(estimations[i].tid, NULL);
     if (err != 0)
       ERR("Can't join with a thread");
-    if (NULL != subresult) {
-      cumulativeResult += *subresult;
-      free(subresult);
-    }
   }
-  double result = cumulativeResult / threadCount;
+  double result = mc_pi(progress.hits, progress.samples);
+  double error = mc_pi_stderr(progress.hits, progress.samples);
   printf("PI ~= %f\n", result);
+  printf("95%% confidence interval: [%f, %f] after %lu samples\n",
+         result - MC_Z95 * error, result + MC_Z95 * error, progress.samples);
   free(estimations);
 }
@@ -0,0 +1,836 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lab02/sop_transport.h"
+#include "../lab03/sop_shm.h"
+#include "../lab04/sop_net.h"
+
+// sop_net.h only exits, a benchmark has to take its other processes down too
+#undef ERR
+#define ERR(source) \
+    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+
+#define MAXN 256
+#define MAX_SIZES 32
+#define MAX_SENDERS 64
+#define WARMUP_ROUNDS 10
+#define DEFAULT_ROUNDS 2000
+#define LATENCY_BYTES (256 << 20)  // round trips are cut down so that one latency test moves at most this much
+#define DEFAULT_BYTES (64 << 20)
+#define MAX_MESSAGES 200000
+#define MQ_DEPTH 10
+#define RING_DEPTH 64
+#define RING_BYTES (16 << 20)
+#define SHM_PIPE_CAPACITY (1 << 20)
+#define UDP_MAX 65507
+#define UDP_IDLE_MS 500
+#define RECV_BUF (1 << 20)
+
+typedef enum
+{
+    M_PIPE,
+    M_FIFO,
+    M_MQ,
+    M_RING,
+    M_SHM,
+    M_UNIX,
+    M_TCP,
+    M_UDP,
+    M_COUNT
+} mech_t;
+
+const char *mech_names[M_COUNT] = {"pipe", "fifo", "mq", "ring", "shm", "unix", "tcp", "udp"};
+
+// A byte stream in shared memory guarded by a pshared mutex, the lab03 way of passing data between processes.
+typedef struct shm_pipe
+{
+    pthread_mutex_t mtx;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int writers;
+    char data[];
+} shm_pipe_t;
+
+// Everything one test needs, set up by the parent before it forks.
+typedef struct test
+{
+    mech_t mech;
+    size_t size;
+    char path[2][MAXN];
+    char port[16];
+    int listen_fd;
+    int pipe_fds[2][2];
+    int fifo_fd;
+    transport_t tr[2];
+    shm_pipe_t *shm[2];
+    int udp[2];
+} test_t;
+
+// One side of a connection. Sockets and the ring of a pair of one-way channels look the same from here.
+typedef struct endpoint
+{
+    mech_t mech;
+    int rx_fd;
+    int tx_fd;
+    transport_t *rx;
+    transport_t *tx;
+    shm_pipe_t *shm_rx;
+    shm_pipe_t *shm_tx;
+} endpoint_t;
+
+typedef struct gate
+{
+    int ready[2];
+    int start[2];
+} gate_t;
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime");
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int shm_pipe_lock(shm_pipe_t *p)
+{
+    int err = pthread_mutex_lock(&p->mtx);
+    if (err == EOWNERDEAD)
+        err = pthread_mutex_consistent(&p->mtx);
+    return err;
+}
+
+shm_pipe_t *shm_pipe_create(size_t capacity, int writers)
+{
+    shm_pipe_t *p =
+        mmap(NULL, sizeof(shm_pipe_t) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        ERR("mmap");
+    int err;
+    if ((err = shm_mutex_init(&p->mtx)))
+    {
+        errno = err;
+        ERR("pthread_mutex_init");
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (pthread_cond_init(&p->readable, &attr) || pthread_cond_init(&p->writable, &attr))
+        ERR("pthread_cond_init");
+    pthread_condattr_destroy(&attr);
+    p->capacity = capacity;
+    p->writers = writers;
+    return p;
+}
+
+void shm_pipe_destroy(shm_pipe_t *p)
+{
+    pthread_cond_destroy(&p->readable);
+    pthread_cond_destroy(&p->writable);
+    pthread_mutex_destroy(&p->mtx);
+    if (munmap(p, sizeof(shm_pipe_t) + p->capacity))
+        ERR("munmap");
+}
+
+// Blocks until all `n` bytes are in the pipe, like a write to a pipe.
+void shm_pipe_write(shm_pipe_t *p, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        if (shm_pipe_lock(p))
+            ERR("pthread_mutex_lock");
+        while (p->count == p->capacity)
+            pthread_cond_wait(&p->writable, &p->mtx);
+        size_t tail = (p->head + p->count) % p->capacity;
+        size_t chunk = p->capacity - p->count;
+        chunk = chunk < n ? chunk : n;
+        size_t first = p->capacity - tail < chunk ? p->capacity - tail : chunk;
+        memcpy(p->data + tail, buf, first);
+        memcpy(p->data, buf + first, chunk - first);
+        p->count += chunk;
+        pthread_cond_signal(&p->readable);
+        pthread_mutex_unlock(&p->mtx);
+        buf += chunk;
+        n -= chunk;
+    }
+}
+
+// Returns up to `n` bytes as soon as there are any, 0 once all the writers have closed the pipe and it is empty.
+size_t shm_pipe_read(shm_pipe_t *p, char *buf, size_t n)
+{
+    if (shm_pipe_lock(p))
+        ERR("pthread_mutex_lock");
+    while (p->count == 0 && p->writers > 0)
+        pthread_cond_wait(&p->readable, &p->mtx);
+    size_t chunk = p->count < n ? p->count : n;
+    size_t first = p->capacity - p->head < chunk ? p->capacity - p->head : chunk;
+    memcpy(buf, p->data + p->head, first);
+    memcpy(buf + first, p->data, chunk - first);
+    p->head = (p->head + chunk) % p->capacity;
+    p->count -= chunk;
+    // several writers may wait for room
+    pthread_cond_broadcast(&p->writable);
+    pthread_mutex_unlock(&p->mtx);
+    return chunk;
+}
+
+void shm_pipe_close_writer(shm_pipe_t *p)
+{
+    if (shm_pipe_lock(p))
+        ERR("pthread_mutex_lock");
+    p->writers--;
+    pthread_cond_broadcast(&p->readable);
+    pthread_mutex_unlock(&p->mtx);
+}
+
+int bind_udp_socket(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int fd = make_socket(SOCK_DGRAM);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        ERR("bind");
+    return fd;
+}
+
+void connect_udp_socket(int fd, int peer)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(peer, (struct sockaddr *)&addr, &len))
+        ERR("getsockname");
+    if (connect(fd, (struct sockaddr *)&addr, len))
+        ERR("connect");
+}
+
+void set_nodelay(int fd)
+{
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+        ERR("setsockopt");
+}
+
+int accept_client(int listen_fd)
+{
+    int fd = TEMP_FAILURE_RETRY(accept(listen_fd, NULL, NULL));
+    if (fd < 0)
+        ERR("accept");
+    return fd;
+}
+
+/**
+ * Sets up the channels of a test, `channels` of them (one for the throughput test, a pair for the round trips), and
+ * `writers` writers of the first one.
+ * @return 0, or -1 if the mechanism can't carry messages of this size.
+ */
+int test_prepare(test_t *t, mech_t mech, size_t size, int channels, int writers)
+{
+    memset(t, 0, sizeof(test_t));
+    t->mech = mech;
+    t->size = size;
+    t->listen_fd = t->fifo_fd = t->udp[0] = t->udp[1] = -1;
+    switch (mech)
+    {
+        case M_PIPE:
+            for (int i = 0; i < channels; i++)
+                if (pipe(t->pipe_fds[i]))
+                    ERR("pipe");
+            break;
+        case M_FIFO:
+            for (int i = 0; i < channels; i++)
+            {
+                snprintf(t->path[i], MAXN, "/tmp/ipc_bench_%d_%d", getpid(), i);
+                if (mkfifo(t->path[i], 0600))
+                    ERR("mkfifo");
+            }
+            // open before the writers, so that the reader doesn't see the end of the data before they come
+            if (channels == 1 && (t->fifo_fd = open(t->path[0], O_RDONLY | O_NONBLOCK)) < 0)
+                ERR("open");
+            break;
+        case M_MQ:
+        case M_RING:
+        {
+            tr_kind_t kind = mech == M_MQ ? TR_MQ : TR_RING;
+            // keep a ring of big messages within RING_BYTES
+            size_t depth = mech == M_MQ ? MQ_DEPTH : RING_BYTES / size;
+            depth = depth > RING_DEPTH ? RING_DEPTH : depth < 2 ? 2 : depth;
+            for (int i = 0; i < channels; i++)
+            {
+                snprintf(t->path[i], MAXN, "/ipc_bench_%d_%d", getpid(), i);
+                if (tr_unlink(kind, t->path[i]) && errno != ENOENT)
+                    ERR("tr_unlink");
+                if (tr_open(&t->tr[i], kind, t->path[i], TR_CREAT, depth, size))
+                {
+                    // above /proc/sys/fs/mqueue/msgsize_max
+                    if (errno != EINVAL && errno != ENOMEM && errno != EMFILE)
+                        ERR("tr_open");
+                    for (int j = 0; j < i; j++)
+                        if (tr_close(&t->tr[j]) || tr_unlink(kind, t->path[j]))
+                            ERR("tr_close");
+                    return -1;
+                }
+            }
+            break;
+        }
+        case M_SHM:
+            for (int i = 0; i < channels; i++)
+                t->shm[i] = shm_pipe_create(SHM_PIPE_CAPACITY, i == 0 ? writers : 1);
+            break;
+        case M_UNIX:
+            snprintf(t->path[0], MAXN, "/tmp/ipc_bench_%d.sock", getpid());
+            t->listen_fd = bind_local_socket(t->path[0], MAX_SENDERS);
+            break;
+        case M_TCP:
+        {
+            t->listen_fd = bind_socket(0, SOCK_STREAM, MAX_SENDERS);
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            if (getsockname(t->listen_fd, (struct sockaddr *)&addr, &len))
+                ERR("getsockname");
+            snprintf(t->port, sizeof(t->port), "%d", ntohs(addr.sin_port));
+            break;
+        }
+        case M_UDP:
+            if (size > UDP_MAX)
+                return -1;
+            for (int i = 0; i < 2; i++)
+                t->udp[i] = bind_udp_socket();
+            if (channels == 2)
+            {
+                connect_udp_socket(t->udp[0], t->udp[1]);
+                connect_udp_socket(t->udp[1], t->udp[0]);
+            }
+            else
+            {
+                // the benchmark counts what gets through, give the receiver room for bursts
+                int buf = 4 << 20;
+                setsockopt(t->udp[1], SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+            }
+            break;
+        case M_COUNT:
+            break;
+    }
+    return 0;
+}
+
+// Releases what the parent holds, the children exit without cleaning up.
+void test_cleanup(test_t *t)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 2; j++)
+            if (t->pipe_fds[i][j] > 0)
+                close(t->pipe_fds[i][j]);
+        if (t->mech == M_FIFO && t->path[i][0] && unlink(t->path[i]))
+            ERR("unlink");
+        if ((t->mech == M_MQ || t->mech == M_RING) && t->path[i][0])
+        {
+            if (tr_close(&t->tr[i]) || tr_unlink(t->mech == M_MQ ? TR_MQ : TR_RING, t->path[i]))
+                ERR("tr_close");
+        }
+        if (t->shm[i])
+            shm_pipe_destroy(t->shm[i]);
+        if (t->udp[i] >= 0)
+            close(t->udp[i]);
+    }
+    if (t->fifo_fd >= 0)
+        close(t->fifo_fd);
+    if (t->listen_fd >= 0)
+        close(t->listen_fd);
+    if (t->mech == M_UNIX && unlink(t->path[0]))
+        ERR("unlink");
+}
+
+// Connects one end of the round trip test, the server echoes what the client sends.
+void attach_pair(test_t *t, endpoint_t *ep, int server)
+{
+    memset(ep, 0, sizeof(endpoint_t));
+    ep->mech = t->mech;
+    int in = server ? 0 : 1, out = server ? 1 : 0;
+    switch (t->mech)
+    {
+        case M_PIPE:
+            ep->rx_fd = t->pipe_fds[in][0];
+            ep->tx_fd = t->pipe_fds[out][1];
+            break;
+        case M_FIFO:
+            // both open channel 0 first, opening a FIFO waits for the other side
+            if (server)
+            {
+                ep->rx_fd = TEMP_FAILURE_RETRY(open(t->path[0], O_RDONLY));
+                ep->tx_fd = TEMP_FAILURE_RETRY(open(t->path[1], O_WRONLY));
+            }
+            else
+            {
+                ep->tx_fd = TEMP_FAILURE_RETRY(open(t->path[0], O_WRONLY));
+                ep->rx_fd = TEMP_FAILURE_RETRY(open(t->path[1], O_RDONLY));
+            }
+            if (ep->rx_fd < 0 || ep->tx_fd < 0)
+                ERR("open");
+            break;
+        case M_MQ:
+        case M_RING:
+            ep->rx = &t->tr[in];
+            ep->tx = &t->tr[out];
+            break;
+        case M_SHM:
+            ep->shm_rx = t->shm[in];
+            ep->shm_tx = t->shm[out];
+            break;
+        case M_UNIX:
+            ep->rx_fd = ep->tx_fd = server ? accept_client(t->listen_fd) : connect_local_socket(t->path[0]);
+            break;
+        case M_TCP:
+            ep->rx_fd = ep->tx_fd = server ? accept_client(t->listen_fd) : connect_tcp_socket("127.0.0.1", t->port);
+            set_nodelay(ep->rx_fd);
+            break;
+        case M_UDP:
+            ep->rx_fd = ep->tx_fd = t->udp[server];
+            break;
+        case M_COUNT:
+            break;
+    }
+}
+
+// Connects a sender of the throughput test.
+void attach_sender(test_t *t, endpoint_t *ep)
+{
+    memset(ep, 0, sizeof(endpoint_t));
+    ep->mech = t->mech;
+    switch (t->mech)
+    {
+        case M_PIPE:
+            close(t->pipe_fds[0][0]);
+            ep->tx_fd = t->pipe_fds[0][1];
+            break;
+        case M_FIFO:
+            close(t->fifo_fd);
+            if ((ep->tx_fd = TEMP_FAILURE_RETRY(open(t->path[0], O_WRONLY))) < 0)
+                ERR("open");
+            break;
+        case M_MQ:
+        case M_RING:
+            ep->tx = &t->tr[0];
+            break;
+        case M_SHM:
+            ep->shm_tx = t->shm[0];
+            break;
+        case M_UNIX:
+            ep->tx_fd = connect_local_socket(t->path[0]);
+            break;
+        case M_TCP:
+            ep->tx_fd = connect_tcp_socket("127.0.0.1", t->port);
+            break;
+        case M_UDP:
+            ep->tx_fd = bind_udp_socket();
+            connect_udp_socket(ep->tx_fd, t->udp[1]);
+            break;
+        case M_COUNT:
+            break;
+    }
+}
+
+void ep_send(endpoint_t *ep, char *buf, size_t n)
+{
+    if (ep->tx != NULL)
+    {
+        if (TEMP_FAILURE_RETRY(tr_send(ep->tx, buf, n, 0, -1)) < 0)
+            ERR("tr_send");
+    }
+    else if (ep->shm_tx != NULL)
+        shm_pipe_write(ep->shm_tx, buf, n);
+    else if (bulk_write(ep->tx_fd, buf, n) < 0)
+        ERR("write");
+}
+
+// Receives one whole message of `n` bytes, `buf` must be big enough for the largest message of the test.
+void ep_receive(endpoint_t *ep, char *buf, size_t n)
+{
+    if (ep->rx != NULL)
+    {
+        if (TEMP_FAILURE_RETRY(tr_receive(ep->rx, buf, ep->rx->msg_size, NULL, -1)) != (ssize_t)n)
+            ERR("tr_receive");
+    }
+    else if (ep->shm_rx != NULL)
+    {
+        for (size_t got = 0; got < n;)
+            got += shm_pipe_read(ep->shm_rx, buf + got, n - got);
+    }
+    else if (bulk_read(ep->rx_fd, buf, n) != (ssize_t)n)
+        ERR("read");
+}
+
+// Children wait until all of them are connected and the parent lets them go, so that neither forking nor
+// connecting is measured.
+void gate_open(gate_t *g)
+{
+    if (pipe(g->ready) || pipe(g->start))
+        ERR("pipe");
+}
+
+void gate_pass(gate_t *g)
+{
+    char c = 0;
+    if (close(g->ready[0]) || close(g->start[1]))
+        ERR("close");
+    if (TEMP_FAILURE_RETRY(write(g->ready[1], &c, 1)) != 1)
+        ERR("write");
+    if (TEMP_FAILURE_RETRY(read(g->start[0], &c, 1)) < 0)
+        ERR("read");
+    if (close(g->ready[1]) || close(g->start[0]))
+        ERR("close");
+}
+
+uint64_t gate_release(gate_t *g, int children)
+{
+    char buf[MAX_SENDERS];
+    if (close(g->ready[1]) || close(g->start[0]))
+        ERR("close");
+    if (bulk_read(g->ready[0], buf, children) != children)
+        ERR("read");
+    uint64_t begin = now_ns();
+    if (close(g->ready[0]) || close(g->start[1]))
+        ERR("close");
+    return begin;
+}
+
+void wait_children(void)
+{
+    int status, failed = 0;
+    while (wait(&status) > 0)
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    if (failed)
+    {
+        fprintf(stderr, "a child of the benchmark has failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile_us(uint64_t *sorted, int n, double p) { return sorted[(int)(p * (n - 1))] / 1e3; }
+
+/**
+ * Bounces a message between the parent and an echoing child `rounds` times and prints the round trip percentiles.
+ */
+void bench_latency(mech_t mech, size_t size, int rounds, char *buf)
+{
+    test_t t;
+    if (test_prepare(&t, mech, size, 2, 1))
+    {
+        printf("%-5s %8zu %10s\n", mech_names[mech], size, "n/a");
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        ERR("fork");
+    if (pid == 0)
+    {
+        endpoint_t ep;
+        attach_pair(&t, &ep, 1);
+        for (int i = 0; i < WARMUP_ROUNDS + rounds; i++)
+        {
+            ep_receive(&ep, buf, size);
+            ep_send(&ep, buf, size);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    endpoint_t ep;
+    attach_pair(&t, &ep, 0);
+    uint64_t *samples = malloc(rounds * sizeof(uint64_t));
+    if (samples == NULL)
+        ERR("malloc");
+    for (int i = 0; i < WARMUP_ROUNDS + rounds; i++)
+    {
+        uint64_t begin = now_ns();
+        ep_send(&ep, buf, size);
+        ep_receive(&ep, buf, size);
+        if (i >= WARMUP_ROUNDS)
+            samples[i - WARMUP_ROUNDS] = now_ns() - begin;
+    }
+    wait_children();
+    qsort(samples, rounds, sizeof(uint64_t), compare_u64);
+    printf("%-5s %8zu %10.2f %10.2f %10.2f %10.2f %8d\n", mech_names[mech], size, percentile_us(samples, rounds, 0.5),
+           percentile_us(samples, rounds, 0.9), percentile_us(samples, rounds, 0.99),
+           samples[rounds - 1] / 1e3, rounds);
+    free(samples);
+    if (mech == M_FIFO || mech == M_UNIX || mech == M_TCP)
+    {
+        close(ep.rx_fd);
+        if (ep.tx_fd != ep.rx_fd)
+            close(ep.tx_fd);
+    }
+    test_cleanup(&t);
+}
+
+// Reads everything the senders of a stream mechanism send, from one descriptor or from a connection per sender.
+uint64_t receive_streams(int *fds, int n, char *buf)
+{
+    uint64_t total = 0;
+    struct pollfd pfds[MAX_SENDERS];
+    for (int i = 0; i < n; i++)
+        pfds[i] = (struct pollfd){.fd = fds[i], .events = POLLIN};
+    for (int open = n; open > 0;)
+    {
+        if (n > 1 && TEMP_FAILURE_RETRY(poll(pfds, n, -1)) < 0)
+            ERR("poll");
+        for (int i = 0; i < n; i++)
+        {
+            if (pfds[i].fd < 0 || (n > 1 && pfds[i].revents == 0))
+                continue;
+            ssize_t count = TEMP_FAILURE_RETRY(read(pfds[i].fd, buf, RECV_BUF));
+            if (count < 0)
+                ERR("read");
+            if (count == 0)
+            {
+                pfds[i].fd = -1;
+                open--;
+            }
+            total += count;
+        }
+    }
+    return total;
+}
+
+/**
+ * `senders` children push `messages` messages of `size` bytes in total to the parent.
+ * Prints messages and megabytes per second, counted from the start signal until the parent has everything (or, for
+ * UDP, the last datagram which got through).
+ */
+void bench_throughput(mech_t mech, size_t size, int senders, int messages, char *buf)
+{
+    test_t t;
+    if (test_prepare(&t, mech, size, 1, senders))
+    {
+        printf("%-5s %8zu %7d %12s\n", mech_names[mech], size, senders, "n/a");
+        return;
+    }
+    gate_t gate;
+    gate_open(&gate);
+    for (int i = 0; i < senders; i++)
+    {
+        int share = messages / senders + (i < messages % senders);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+            ERR("fork");
+        if (pid == 0)
+        {
+            endpoint_t ep;
+            attach_sender(&t, &ep);
+            memset(buf, 'x', size);
+            gate_pass(&gate);
+            for (int j = 0; j < share; j++)
+                ep_send(&ep, buf, size);
+            if (ep.shm_tx != NULL)
+                shm_pipe_close_writer(ep.shm_tx);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    int fds[MAX_SENDERS], n_fds = 1;
+    if (mech == M_PIPE)
+    {
+        close(t.pipe_fds[0][1]);
+        t.pipe_fds[0][1] = -1;
+        fds[0] = t.pipe_fds[0][0];
+    }
+    else if (mech == M_FIFO)
+    {
+        // every sender has the FIFO open once the gate is passed, from then on an empty FIFO means more is coming
+        fds[0] = t.fifo_fd;
+    }
+    uint64_t begin = gate_release(&gate, senders), end = 0;
+    if (mech == M_FIFO && fcntl(t.fifo_fd, F_SETFL, 0))
+        ERR("fcntl");
+    if (mech == M_UNIX || mech == M_TCP)
+    {
+        for (n_fds = 0; n_fds < senders; n_fds++)
+            fds[n_fds] = accept_client(t.listen_fd);
+    }
+
+    uint64_t expected = (uint64_t)messages * size, got = 0;
+    if (mech == M_MQ || mech == M_RING)
+    {
+        for (int i = 0; i < messages; i++)
+            if (TEMP_FAILURE_RETRY(tr_receive(&t.tr[0], buf, size, NULL, -1)) < 0)
+                ERR("tr_receive");
+        got = expected;
+    }
+    else if (mech == M_SHM)
+    {
+        size_t count;
+        while ((count = shm_pipe_read(t.shm[0], buf, RECV_BUF)) > 0)
+            got += count;
+    }
+    else if (mech == M_UDP)
+    {
+        // datagrams which don't fit into the receive buffer are dropped, wait until nothing comes for a while
+        struct pollfd pfd = {.fd = t.udp[1], .events = POLLIN};
+        while (got < expected && TEMP_FAILURE_RETRY(poll(&pfd, 1, UDP_IDLE_MS)) > 0)
+        {
+            ssize_t count = recv(t.udp[1], buf, size, 0);
+            if (count < 0)
+                ERR("recv");
+            got += count;
+            end = now_ns();
+        }
+    }
+    else
+        got = receive_streams(fds, n_fds, buf);
+    if (end == 0)
+        end = now_ns();
+    wait_children();
+    if (mech == M_UNIX || mech == M_TCP)
+        for (int i = 0; i < n_fds; i++)
+            close(fds[i]);
+    test_cleanup(&t);
+
+    if (mech != M_UDP && got != expected)
+    {
+        fprintf(stderr, "%s: got %lu bytes instead of %lu\n", mech_names[mech], got, expected);
+        exit(EXIT_FAILURE);
+    }
+    double seconds = (end - begin) / 1e9, delivered = (double)got / size;
+    printf("%-5s %8zu %7d %12.0f %10.1f %7.2f%%\n", mech_names[mech], size, senders, delivered / seconds,
+           got / seconds / 1e6, 100.0 * (messages - delivered) / messages);
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-m mechanisms] [-s sizes] [-p senders] [-n round_trips] [-b bytes]\n", name);
+    fprintf(stderr, "mechanisms - comma separated, from pipe,fifo,mq,ring,shm,unix,tcp,udp (default all)\n");
+    fprintf(stderr, "sizes - comma separated message sizes, k and m suffixes allowed (default 8,64,512,4k,64k,1m)\n");
+    fprintf(stderr, "senders - comma separated numbers of senders in the throughput test, up to %d (default 1,4)\n",
+            MAX_SENDERS);
+    fprintf(stderr, "round_trips - per latency test, default %d (fewer for messages over %d kB)\n", DEFAULT_ROUNDS,
+            LATENCY_BYTES / DEFAULT_ROUNDS / 1024);
+    fprintf(stderr, "bytes - sent in each throughput test, default %dm (at most %d messages)\n", DEFAULT_BYTES >> 20,
+            MAX_MESSAGES);
+    fprintf(stderr, "mq: sizes above /proc/sys/fs/mqueue/msgsize_max are n/a, udp: above %d\n", UDP_MAX);
+    exit(EXIT_FAILURE);
+}
+
+long parse_size(char *s)
+{
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*end == 'k' || *end == 'K')
+        v <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        v <<= 20, end++;
+    return *end == '\0' ? v : -1;
+}
+
+// Splits a comma separated list into `values`. Returns their number, or -1 if any of them is invalid.
+int parse_list(char *list, long *values, int max, long (*parse)(char *))
+{
+    int n = 0;
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        if (n == max || (values[n] = parse(item)) <= 0)
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+long parse_mech(char *s)
+{
+    for (int i = 0; i < M_COUNT; i++)
+        if (strcmp(s, mech_names[i]) == 0)
+            return i + 1;
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    char default_sizes[] = "8,64,512,4k,64k,1m", default_senders[] = "1,4";
+    long mechs[M_COUNT], sizes[MAX_SIZES], senders[MAX_SIZES];
+    int n_mechs = M_COUNT, n_sizes = parse_list(default_sizes, sizes, MAX_SIZES, parse_size);
+    int n_senders = parse_list(default_senders, senders, MAX_SIZES, parse_size);
+    int rounds = DEFAULT_ROUNDS, c;
+    long bytes = DEFAULT_BYTES;
+    for (int i = 0; i < M_COUNT; i++)
+        mechs[i] = i + 1;
+    while ((c = getopt(argc, argv, "m:s:p:n:b:")) != -1)
+    {
+        switch (c)
+        {
+            case 'm':
+                n_mechs = parse_list(optarg, mechs, M_COUNT, parse_mech);
+                break;
+            case 's':
+                n_sizes = parse_list(optarg, sizes, MAX_SIZES, parse_size);
+                break;
+            case 'p':
+                n_senders = parse_list(optarg, senders, MAX_SIZES, parse_size);
+                break;
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            case 'b':
+                bytes = parse_size(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc != optind || n_mechs <= 0 || n_sizes <= 0 || n_senders <= 0 || rounds <= 0 || bytes <= 0)
+        usage(argv[0]);
+    long max_size = 0;
+    for (int i = 0; i < n_sizes; i++)
+        max_size = sizes[i] > max_size ? sizes[i] : max_size;
+    for (int i = 0; i < n_senders; i++)
+        if (senders[i] > MAX_SENDERS)
+            usage(argv[0]);
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        ERR("signal");
+    char *buf = malloc(max_size > RECV_BUF ? max_size : RECV_BUF);
+    if (buf == NULL)
+        ERR("malloc");
+    memset(buf, 'x', max_size);
+
+    printf("round trip latency [us]\n%-5s %8s %10s %10s %10s %10s %8s\n", "mech", "size", "p50", "p90", "p99", "max",
+           "rounds");
+    for (int m = 0; m < n_mechs; m++)
+        for (int s = 0; s < n_sizes; s++)
+        {
+            int n = LATENCY_BYTES / sizes[s] < rounds ? LATENCY_BYTES / sizes[s] : rounds;
+            bench_latency(mechs[m] - 1, sizes[s], n > WARMUP_ROUNDS ? n : WARMUP_ROUNDS, buf);
+        }
+
+    printf("\none-way throughput\n%-5s %8s %7s %12s %10s %8s\n", "mech", "size", "senders", "msg/s", "MB/s", "lost");
+    for (int m = 0; m < n_mechs; m++)
+        for (int s = 0; s < n_sizes; s++)
+            for (int p = 0; p < n_senders; p++)
+            {
+                long messages = bytes / sizes[s];
+                messages = messages > MAX_MESSAGES ? MAX_MESSAGES : messages < senders[p] ? senders[p] : messages;
+                bench_throughput(mechs[m] - 1, sizes[s], senders[p], messages, buf);
+            }
+    free(buf);
+    return EXIT_SUCCESS;
+}
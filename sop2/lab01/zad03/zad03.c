@@ -1,7 +1,9 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,8 +14,28 @@
 #include <unistd.h>
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
-#define BUF_SZ 256
+#define MSG_SZ 48
 #define STAGES 4
+#define REPORT_BATCH 64  // records the teacher reads at once
+
+enum report_type
+{
+    REPORT_HERE,
+    REPORT_RESULT
+};
+
+// Everything a student sends on the common pipe, in a single write. Writes of up to PIPE_BUF bytes are atomic, so
+// records of different students never interleave and the teacher can read many of them at once.
+typedef struct report
+{
+    int32_t type;
+    int32_t id;
+    int32_t pid;
+    int32_t res;
+    char msg[MSG_SZ];
+} __attribute__((packed)) report_t;
+
+_Static_assert(sizeof(report_t) <= PIPE_BUF, "a report must be written atomically");
 
 volatile sig_atomic_t done = 0;
 
@@ -48,41 +70,28 @@ void child_work(int id, int personal_read, int common_write)
     int pid = getpid();
     srand(pid);
     int skill = rand() % 7 + 3;
-    int len = 0;
     printf("Student [%d]\n", pid);
 
-    if (TEMP_FAILURE_RETRY(read(personal_read, &len, sizeof(int))) < 0)
-        ERR("read");
-    char* buf = malloc(BUF_SZ * sizeof(char));
-    if (buf == NULL)
-        ERR("malloc");
-    if (TEMP_FAILURE_RETRY(read(personal_read, &buf, len)) < 0)
+    char buf[MSG_SZ];
+    if (TEMP_FAILURE_RETRY(read(personal_read, buf, MSG_SZ)) < MSG_SZ)
         ERR("read");
 
-    char* msg = malloc(BUF_SZ * sizeof(char));
-    if (msg == NULL)
-        ERR("malloc");
-    memset(msg, 0, BUF_SZ);
-    sprintf(msg, "Student [%d]: HERE", pid);
-    printf("%s\n", msg);
-    len = strlen(msg);
-    if (TEMP_FAILURE_RETRY(write(common_write, &len, sizeof(int))) < 0)
-        ERR("write");
-    if (TEMP_FAILURE_RETRY(write(common_write, &msg, len)) < 0)
+    report_t report = {.type = REPORT_HERE, .id = id, .pid = pid};
+    snprintf(report.msg, MSG_SZ, "Student [%d]: HERE", pid);
+    printf("%s\n", report.msg);
+    if (TEMP_FAILURE_RETRY(write(common_write, &report, sizeof(report_t))) < 0)
         ERR("write");
 
     int stage = 0;
+    report.type = REPORT_RESULT;
+    memset(report.msg, 0, MSG_SZ);
     while (stage <= 3)
     {
         int t = rand() % 401 + 100;
         msleep(t);
         int q = rand() % 20 + 1;
-        int res = skill + q;
-        if (TEMP_FAILURE_RETRY(write(common_write, &id, sizeof(int))) < 0)
-            ERR("write");
-        if (TEMP_FAILURE_RETRY(write(common_write, &pid, sizeof(pid_t))) < 0)
-            ERR("write");
-        if (TEMP_FAILURE_RETRY(write(common_write, &res, sizeof(int))) < 0)
+        report.res = skill + q;
+        if (TEMP_FAILURE_RETRY(write(common_write, &report, sizeof(report_t))) < 0)
             ERR("write");
         char is_ok;
         if (TEMP_FAILURE_RETRY(read(personal_read, &is_ok, sizeof(char))) < 0)
@@ -91,77 +100,121 @@ void child_work(int id, int personal_read, int common_write)
             stage++;
     }
     printf("Student [%d]: I NAILED IT!\n", pid);
+}
+
+// Reads at least one whole report into `reports`, as many as there are up to REPORT_BATCH. Bytes of an incomplete
+// record stay at the beginning of the array for the next call, *have counts them. Returns the number of reports.
+int read_reports(int common_read, report_t* reports, size_t* have)
+{
+    char* bytes = (char*)reports;
+    while (*have < sizeof(report_t))
+    {
+        ssize_t len = TEMP_FAILURE_RETRY(read(common_read, bytes + *have, REPORT_BATCH * sizeof(report_t) - *have));
+        if (len < 0)
+            ERR("read");
+        if (len == 0)
+        {
+            fprintf(stderr, "Teacher: all the students have left\n");
+            exit(EXIT_FAILURE);
+        }
+        *have += len;
+    }
+    return *have / sizeof(report_t);
+}
 
-    free(msg);
-    free(buf);
+// Moves the bytes of a record which was not read whole to the beginning of `reports`.
+void keep_rest(report_t* reports, int count, size_t* have)
+{
+    *have -= count * sizeof(report_t);
+    memmove(reports, reports + count, *have);
 }
 
-// parent has an array of "personal" write-ends and one read-end
-void parent_work(int n, int* child_pids, int* personal_writes, int common_read)
+// Grades a result and tells the student whether it passed. Returns 1 if the student has passed the last stage.
+int handle_result(report_t* report, int n, int* stage, int* personal_writes)
 {
     const int POINTS[STAGES] = {3, 6, 7, 5};
 
+    int id = report->id, pid = report->pid, res = report->res;
+    if (report->type != REPORT_RESULT || id < 0 || id >= n)
+    {
+        fprintf(stderr, "Teacher: unexpected report\n");
+        exit(EXIT_FAILURE);
+    }
+    char is_ok;
+    int finished = 0;
+    if (res >= POINTS[stage[id]] + rand() % 20 + 1)
+    {
+        printf("Teacher: Student [%d] finished stage %d\n", pid, stage[id] + 1);
+        stage[id]++;
+        finished = stage[id] > 3;
+        is_ok = '1';
+    }
+    else
+    {
+        printf("Teacher: Student [%d] needs to fix stage %d\n", pid, stage[id] + 1);
+        is_ok = '0';
+    }
+    if (TEMP_FAILURE_RETRY(write(personal_writes[id], &is_ok, sizeof(char))) < 0)
+        ERR("write");
+    return finished;
+}
+
+// parent has an array of "personal" write-ends and one read-end
+void parent_work(int n, int* child_pids, int* personal_writes, int common_read)
+{
     srand(time(NULL));
-    char* msg = malloc(BUF_SZ * sizeof(char));
-    if (msg == NULL)
+    report_t* reports = malloc(REPORT_BATCH * sizeof(report_t));
+    if (reports == NULL)
         ERR("malloc");
-    char* buf = malloc(BUF_SZ * sizeof(char));
-    if (buf == NULL)
+    size_t have = 0;
+    long n_reports = 0, n_reads = 0;
+    int remaining = n;
+    int* stage = malloc(n * sizeof(int));
+    if (stage == NULL)
         ERR("malloc");
-    int len = 0;
+    memset(stage, 0, n * sizeof(int));
 
     for (int i = 0; i < n; i++)
     {
-        memset(msg, 0, BUF_SZ);
-        sprintf(msg, "Teacher: Is [%d] here?", child_pids[i]);
-        len = strlen(msg);
-        if (TEMP_FAILURE_RETRY(write(personal_writes[i], &len, sizeof(int))) < 0)
-            ERR("write");
-        if (TEMP_FAILURE_RETRY(write(personal_writes[i], &msg, len)) < 0)
+        char msg[MSG_SZ] = {0};
+        snprintf(msg, MSG_SZ, "Teacher: Is [%d] here?", child_pids[i]);
+        if (TEMP_FAILURE_RETRY(write(personal_writes[i], msg, MSG_SZ)) < 0)
             ERR("write");
         printf("%s\n", msg);
 
-        if (TEMP_FAILURE_RETRY(read(common_read, &len, sizeof(int))) < 0)
-            ERR("read");
-        if (TEMP_FAILURE_RETRY(read(common_read, &buf, len)) < 0)
-            ERR("read");
+        // the students called before are already working, their results may come first
+        int here = 0;
+        while (!here)
+        {
+            int count = read_reports(common_read, reports, &have);
+            n_reads++;
+            n_reports += count;
+            for (int j = 0; j < count; j++)
+            {
+                if (reports[j].type == REPORT_HERE && reports[j].id == i)
+                    here = 1;
+                else
+                    remaining -= handle_result(&reports[j], n, stage, personal_writes);
+            }
+            keep_rest(reports, count, &have);
+        }
     }
     alarm(2);
 
-    int remaining = n;
-    int* stage = malloc(n * sizeof(int));
-    memset(stage, 0, n * sizeof(int));
     while (remaining > 0)
     {
-        int id = 0, pid = 0, res = 0;
-        if (TEMP_FAILURE_RETRY(read(common_read, &id, sizeof(int))) < 0)
-            ERR("read");
-        if (TEMP_FAILURE_RETRY(read(common_read, &pid, sizeof(pid_t))) < 0)
-            ERR("read");
-        if (TEMP_FAILURE_RETRY(read(common_read, &res, sizeof(int))) < 0)
-            ERR("read");
-        char is_ok;
-        if (res >= POINTS[stage[id]] + rand() % 20 + 1)
-        {
-            printf("Teacher: Student [%d] finished stage %d\n", pid, stage[id] + 1);
-            stage[id]++;
-            if (stage[id] > 3)
-                remaining--;
-            is_ok = '1';
-        }
-        else
-        {
-            printf("Teacher: Student [%d] needs to fix stage %d\n", pid, stage[id] + 1);
-            is_ok = '0';
-        }
-        if (TEMP_FAILURE_RETRY(write(personal_writes[id], &is_ok, sizeof(char))) < 0)
-            ERR("write");
+        int count = read_reports(common_read, reports, &have);
+        n_reads++;
+        n_reports += count;
+        for (int i = 0; i < count; i++)
+            remaining -= handle_result(&reports[i], n, stage, personal_writes);
+        keep_rest(reports, count, &have);
     }
     printf("Teacher: IT'S FINALLY OVER!\n");
+    printf("Teacher: %ld reports in %ld reads\n", n_reports, n_reads);
 
     free(stage);
-    free(buf);
-    free(msg);
+    free(reports);
 }
 
 void make_children(int n, int* child_pids, int* personal_writes, int* common_read)
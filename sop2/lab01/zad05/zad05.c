@@ -1,11 +1,19 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -13,6 +21,31 @@
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 #define FIFO_PATH "zad05.fifo"
+#define WINNER_RECORD 4  // encode_number bytes, written at once so that the FIFO doesn't split them
+#define WINNER_BATCH 16  // records the parent reads at once
+#define SIM_SLOT_CARDS 64  // cards a player can be ahead of its right neighbour in the simulation
+#define SIM_MAX_PLAYERS 4096
+#define SIM_MAX_CARDS 4096  // cards per player in the simulation, the whole deck takes at most 64 MiB
+
+// A link of the simulated ring, cards passed from player i - 1 to player i. Each side sleeps on the counter the other
+// one moves, and only when it can't go on, so a player keeps going for many rounds without a system call.
+typedef struct card_slot
+{
+    _Alignas(64) _Atomic uint32_t head;  // cards put in by the left player
+    _Atomic uint32_t receiver_waiting;
+    _Alignas(64) _Atomic uint32_t tail;  // cards taken out by the right player
+    _Atomic uint32_t sender_waiting;
+    int cards[SIM_SLOT_CARDS];
+} card_slot_t;
+
+typedef struct card_table
+{
+    _Atomic uint32_t ready;
+    _Atomic uint32_t start;
+    _Atomic uint64_t wins;
+    _Atomic uint64_t sleeps;
+    card_slot_t slots[];
+} card_table_t;
 
 volatile sig_atomic_t last_signal;
 
@@ -28,6 +61,17 @@ int set_handler(void (*f)(int), int signo)
 
 void signal_handler(int signo) { last_signal = signo; }
 
+void usage(char* name)
+{
+    fprintf(stderr, "USAGE: %s n m\n", name);
+    fprintf(stderr, "       %s -s n m rounds\n", name);
+    fprintf(stderr, "n - number of players (4..7, 2..%d with -s)\n", SIM_MAX_PLAYERS);
+    fprintf(stderr, "m - cards per player (4 or more, n * m <= 52; 4..%d with -s)\n", SIM_MAX_CARDS);
+    fprintf(stderr, "-s - simulate `rounds` rounds through shared memory (without the 52 card deck limit) and report "
+                    "rounds/s\n");
+    exit(EXIT_FAILURE);
+}
+
 int check_win(int m, int* hand)
 {
     int color = hand[0] % 4;
@@ -115,10 +159,12 @@ void child_work(int m, int fd_from_parent, int fd_from_left, int fd_to_right)
             int fd_fifo;
             if ((fd_fifo = TEMP_FAILURE_RETRY(open(FIFO_PATH, O_WRONLY))) < 0)
                 ERR("open");
-            unsigned char buf[4];
+            unsigned char buf[WINNER_RECORD];
             encode_number(pid, buf);
-            if (TEMP_FAILURE_RETRY(write(fd_fifo, &buf, 4)) < 4)
+            if (TEMP_FAILURE_RETRY(write(fd_fifo, buf, WINNER_RECORD)) < WINNER_RECORD)
                 ERR("write");
+            if (TEMP_FAILURE_RETRY(close(fd_fifo)) < 0)
+                ERR("close");
             printf("[%d]: Leaving the game!\n", getpid());
             return;
         }
@@ -156,33 +202,178 @@ void parent_work(int n, int m, int* write_fds)
         if (TEMP_FAILURE_RETRY(close(write_fds[i])) < 0)
             ERR("close");
     }
-    int fd_fifo;
+    int fd_fifo, fd_keep, fd_signal;
     if ((fd_fifo = TEMP_FAILURE_RETRY(open(FIFO_PATH, O_RDONLY | O_NONBLOCK))) < 0)
         ERR("open");
+    // a writer of our own, otherwise the FIFO would report a hang-up every time a winner closes it
+    if ((fd_keep = TEMP_FAILURE_RETRY(open(FIFO_PATH, O_WRONLY))) < 0)
+        ERR("open");
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if ((fd_signal = signalfd(-1, &mask, SFD_CLOEXEC)) < 0)
+        ERR("signalfd");
 
-    unsigned char buf[4];
+    struct pollfd fds[2] = {{.fd = fd_fifo, .events = POLLIN}, {.fd = fd_signal, .events = POLLIN}};
+    unsigned char buf[WINNER_BATCH * WINNER_RECORD];
     int end_the_game = 0;
-    for (;;) {
-        int len = TEMP_FAILURE_RETRY(read(fd_fifo, &buf, 4));
-        if (len == -1 && errno != EAGAIN)
-            ERR("read");
-        if (len == 4) {
-            int winner_pid = decode_number(buf);
-            printf("Server: [%d] won!\n", winner_pid);
-            end_the_game = 1;
+    while (!end_the_game)
+    {
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) < 0)
+            ERR("poll");
+        if (fds[0].revents & POLLIN)
+        {
+            ssize_t len = TEMP_FAILURE_RETRY(read(fd_fifo, buf, sizeof(buf)));
+            if (len < 0 && errno != EAGAIN)
+                ERR("read");
+            for (ssize_t i = 0; i + WINNER_RECORD <= len; i += WINNER_RECORD)
+            {
+                printf("Server: [%d] won!\n", decode_number(buf + i));
+                end_the_game = 1;
+            }
         }
-        if (last_signal == SIGINT) {
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (TEMP_FAILURE_RETRY(read(fd_signal, &info, sizeof(info))) != sizeof(info))
+                ERR("read");
             end_the_game = 1;
         }
-        if (end_the_game) {
-            kill(0, SIGUSR1);
-            break;
-        }
     }
+    kill(0, SIGUSR1);
+    if (TEMP_FAILURE_RETRY(close(fd_signal)) < 0)
+        ERR("close");
+    if (TEMP_FAILURE_RETRY(close(fd_keep)) < 0)
+        ERR("close");
     if (TEMP_FAILURE_RETRY(close(fd_fifo)) < 0)
         ERR("close");
 }
 
+void futex_wait(_Atomic uint32_t* word, uint32_t val)
+{
+    // not FUTEX_PRIVATE_FLAG, the word is shared between processes
+    if (syscall(SYS_futex, word, FUTEX_WAIT, val, NULL, NULL, 0) < 0 && errno != EAGAIN && errno != EINTR)
+        ERR("futex");
+}
+
+void futex_wake(_Atomic uint32_t* word, int count)
+{
+    if (syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0) < 0)
+        ERR("futex");
+}
+
+// Sleeps until *word moves away from `val`. Returns how many times it went to sleep.
+int sim_wait(_Atomic uint32_t* word, uint32_t val, _Atomic uint32_t* waiting)
+{
+    int sleeps = 0;
+    atomic_store(waiting, 1);
+    // the other side stores the counter before it looks at `waiting`, we do it the other way round
+    while (atomic_load(word) == val)
+    {
+        futex_wait(word, val);
+        sleeps++;
+    }
+    atomic_store(waiting, 0);
+    return sleeps;
+}
+
+// The game of child_work without pipes: every round the player passes a random card to the right and takes one from
+// the left. A win is counted and the game goes on.
+void sim_player(card_table_t* table, int n, int m, int index, int* hand, long rounds)
+{
+    card_slot_t* in = &table->slots[index];
+    card_slot_t* out = &table->slots[(index + 1) % n];
+    uint64_t wins = 0, sleeps = 0;
+    srand(getpid());
+
+    atomic_fetch_add(&table->ready, 1);
+    futex_wake(&table->ready, 1);
+    while (atomic_load(&table->start) == 0)
+        futex_wait(&table->start, 0);
+
+    for (long r = 0; r < rounds; r++)
+    {
+        int i = rand() % m;
+        uint32_t head = atomic_load_explicit(&out->head, memory_order_relaxed), tail;
+        while (head - (tail = atomic_load(&out->tail)) == SIM_SLOT_CARDS)
+            sleeps += sim_wait(&out->tail, tail, &out->sender_waiting);
+        out->cards[head % SIM_SLOT_CARDS] = hand[i];
+        atomic_store(&out->head, head + 1);
+        if (atomic_load(&out->receiver_waiting))
+            futex_wake(&out->head, 1);
+
+        tail = atomic_load_explicit(&in->tail, memory_order_relaxed);
+        while (atomic_load(&in->head) == tail)
+            sleeps += sim_wait(&in->head, tail, &in->receiver_waiting);
+        hand[i] = in->cards[tail % SIM_SLOT_CARDS];
+        atomic_store(&in->tail, tail + 1);
+        if (atomic_load(&in->sender_waiting))
+            futex_wake(&in->tail, 1);
+        if (check_win(m, hand))
+            wins++;
+    }
+    atomic_fetch_add(&table->wins, wins);
+    atomic_fetch_add(&table->sleeps, sleeps);
+}
+
+/**
+ * Plays `rounds` rounds of n players holding m cards each, dealt from a deck of n * m cards, and reports how many
+ * rounds per second the ring can take.
+ */
+void simulate(int n, int m, long rounds)
+{
+    size_t size = sizeof(card_table_t) + n * sizeof(card_slot_t);
+    card_table_t* table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+        ERR("mmap");
+    int* deck = malloc(n * m * sizeof(int));
+    if (deck == NULL)
+        ERR("malloc");
+    srand(time(NULL));
+    for (int i = 0; i < n * m; i++)
+        deck[i] = i;
+    for (int i = n * m - 1; i > 0; i--)
+    {
+        int j = rand() % (i + 1);
+        int tmp = deck[i];
+        deck[i] = deck[j];
+        deck[j] = tmp;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int pid;
+        if ((pid = fork()) < 0)
+            ERR("fork");
+        if (pid == 0)
+        {
+            sim_player(table, n, m, i, deck + i * m, rounds);
+            free(deck);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    free(deck);
+
+    uint32_t ready;
+    while ((ready = atomic_load(&table->ready)) < (uint32_t)n)
+        futex_wait(&table->ready, ready);
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    atomic_store(&table->start, 1);
+    futex_wake(&table->start, INT_MAX);
+    while (wait(NULL) > 0)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = end.tv_sec - begin.tv_sec + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    double passes = (double)n * rounds;
+    uint64_t sleeps = atomic_load(&table->sleeps);
+    printf("%d players, %d cards, %ld rounds in %.3f s\n", n, m, rounds, seconds);
+    printf("%.0f rounds/s, %.0f cards passed/s, %lu wins, %.1f cards per futex sleep\n", rounds / seconds,
+           passes / seconds, (unsigned long)atomic_load(&table->wins), sleeps ? passes / sleeps : passes);
+    if (munmap(table, size))
+        ERR("munmap");
+}
+
 void make_children(int n, int m, int* write_fds)
 {
     int fds[2];
@@ -212,6 +403,12 @@ void make_children(int n, int m, int* write_fds)
                 ERR("close");
             if (set_handler(signal_handler, SIGUSR1) < 0)
                 ERR("set_handler");
+            // the parent takes SIGINT from its signalfd, players still react to it themselves
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGINT);
+            if (sigprocmask(SIG_UNBLOCK, &mask, NULL) < 0)
+                ERR("sigprocmask");
             child_work(m, fds[0], child_fds_read[i], child_fds_write[i]);
             if (TEMP_FAILURE_RETRY(close(child_fds_read[i])) < 0)
                 ERR("close");
@@ -228,15 +425,23 @@ void make_children(int n, int m, int* write_fds)
 
 int main(int argc, char** argv)
 {
+    if (argc == 5 && strcmp(argv[1], "-s") == 0)
+    {
+        int n = atoi(argv[2]), m = atoi(argv[3]);
+        long rounds = atol(argv[4]);
+        if (n < 2 || n > SIM_MAX_PLAYERS || m < 4 || m > SIM_MAX_CARDS || rounds <= 0)
+            usage(argv[0]);
+        simulate(n, m, rounds);
+        return EXIT_SUCCESS;
+    }
     if (argc < 3)
-        return EXIT_FAILURE;
+        usage(argv[0]);
     int n = atoi(argv[1]);
     if (n < 4 || n > 7)
-        return EXIT_FAILURE;
+        usage(argv[0]);
     int m = atoi(argv[2]);
     if (m < 4 || m * n > 52)
-        return EXIT_FAILURE;
-
+        usage(argv[0]);
     int* write_fds = malloc(n * sizeof(int));
     if (write_fds == NULL)
         ERR("malloc");
@@ -244,6 +449,11 @@ int main(int argc, char** argv)
         ERR("set_handler");
     if (set_handler(signal_handler, SIGINT) < 0)
         ERR("set_handler");
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+        ERR("sigprocmask");
     make_children(n, m, write_fds);
     parent_work(n, m, write_fds);
     while (wait(NULL) > 0)
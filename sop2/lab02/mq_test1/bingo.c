@@ -9,8 +9,12 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "../sop_bcast.h"
+
 #define LIFESPAN 10
 #define MAXN 10
+#define DRAW_HISTORY 64
+#define DRAW_DELAY_MS 1000
 
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
@@ -95,44 +99,64 @@ void msleep(int msec)
         ERR("nanosleep");
 }
 
-void child_work(int id, mqd_t mq_end, mqd_t mq_rng)
+// Every child follows all the draws with its own cursor, a child which can't keep up is told how many it missed.
+void child_work(int id, mqd_t mq_end, bc_ring_t *draws, uint64_t cursor)
 {
     int pid = getpid();
     srand(pid);
     uint8_t my_bingo = (uint8_t)(rand() % MAXN);
     uint8_t number;
+    uint64_t lost = 0;
     int life = rand() % LIFESPAN + 1;
+    // the inherited descriptor doesn't block and many children can finish at the same draw, so wait for room instead
+    if (mq_close(mq_end))
+        ERR("mq_close");
+    if ((mq_end = TEMP_FAILURE_RETRY(mq_open("/bingo_mq_end", O_WRONLY))) == (mqd_t)-1)
+        ERR("mq_open");
     while (life--)
     {
-        if (TEMP_FAILURE_RETRY(mq_receive(mq_rng, (char *)&number, 1, NULL)) < 1)
-            ERR("mq_receive");
+        if (bc_receive(draws, &cursor, &number, &lost) == BC_CLOSED)
+            break;
+        if (lost)
+        {
+            printf("[%d] Missed %lu draws\n", pid, lost);
+            lost = 0;
+        }
         printf("[%d] Received %d\n", pid, number);
         if (my_bingo == number)
         {
             if (TEMP_FAILURE_RETRY(mq_send(mq_end, (const char *)&my_bingo, 1, 1)) != 0)
                 ERR("mq_send");
+            mq_close(mq_end);
             return;
         }
     }
     if (TEMP_FAILURE_RETRY(mq_send(mq_end, (const char *)&id, 1, 0)))
         ERR("mq_send");
+    mq_close(mq_end);
 }
 
-void parent_work(mqd_t mq_rng)
+// A draw is a single write to shared memory and one wake-up of all the children, however many of them there are.
+void parent_work(bc_ring_t *draws, int delay)
 {
     srand(getpid());
+    int count = 0;
     while (children_left)
     {
         uint8_t number = (uint8_t)(rand() % MAXN);
-        if (TEMP_FAILURE_RETRY(mq_send(mq_rng, (const char *)&number, 1, 0)))
-            ERR("mq_send");
-        msleep(1000);
+        bc_publish(draws, &number);
+        count++;
+        if (delay > 0)
+            msleep(delay);
     }
-    printf("[PARENT] Terminating\n");
+    bc_close(draws);
+    printf("[PARENT] Terminating after %d draws\n", count);
 }
 
-void create_children(int n, mqd_t mq_end, mqd_t mq_rng)
+void create_children(int n, mqd_t mq_end, bc_ring_t *draws)
 {
+    // all the children start at the first draw, even if they get to run after it
+    uint64_t cursor = bc_subscribe(draws);
     for (int i = 0; i < n; i++)
     {
         int pid;
@@ -140,7 +164,7 @@ void create_children(int n, mqd_t mq_end, mqd_t mq_rng)
             ERR("fork");
         if (pid == 0)
         {
-            child_work(n, mq_end, mq_rng);
+            child_work(i, mq_end, draws, cursor);
             exit(EXIT_SUCCESS);
         }
         children_left++;
@@ -149,45 +173,50 @@ void create_children(int n, mqd_t mq_end, mqd_t mq_rng)
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s n\n", name);
-    fprintf(stderr, "0 < x < 100 - number of children\n");
+    fprintf(stderr, "USAGE: %s n [delay]\n", name);
+    fprintf(stderr, "0 < n < 100 - number of children\n");
+    fprintf(stderr, "delay - milliseconds between draws, default %d\n", DRAW_DELAY_MS);
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
 {
-    int n;
-    if (argc != 2)
+    int n, delay = DRAW_DELAY_MS;
+    if (argc != 2 && argc != 3)
         usage(argv[0]);
     n = atoi(argv[1]);
-    if (n <= 0 || n >= 100)
+    if (argc == 3)
+        delay = atoi(argv[2]);
+    if (n <= 0 || n >= 100 || delay < 0)
         usage(argv[0]);
 
-    mqd_t mq_end, mq_rng;
+    mqd_t mq_end;
     struct mq_attr attr = {.mq_maxmsg = 10, .mq_msgsize = 1};
     if ((mq_end = TEMP_FAILURE_RETRY(mq_open("/bingo_mq_end", O_RDWR | O_NONBLOCK | O_CREAT, 0600, &attr))) ==
         (mqd_t)-1)
         ERR("mq_open");
-    if ((mq_rng = TEMP_FAILURE_RETRY(mq_open("/bingo_mq_rng", O_RDWR | O_CREAT, 0600, &attr))) == (mqd_t)-1)
-        ERR("mq_open");
+    // an mqueue hands every draw to only one of the children, the broadcast ring shows it to all of them
+    bc_ring_t *draws = bc_create(DRAW_HISTORY, sizeof(uint8_t));
+    if (draws == NULL)
+        ERR("bc_create");
 
     set_handler(sigchld_handler, SIGCHLD);
     set_handler(mq_handler, SIGRTMIN);
-    create_children(n, mq_end, mq_rng);
 
+    // registered before the children start, the notification only comes when the queue stops being empty
     static struct sigevent notif;
     notif.sigev_notify = SIGEV_SIGNAL;
     notif.sigev_signo = SIGRTMIN;
     notif.sigev_value.sival_ptr = &mq_end;
     if (mq_notify(mq_end, &notif) < 0)
         ERR("mq_notify");
-    parent_work(mq_rng);
+    create_children(n, mq_end, draws);
+    parent_work(draws, delay);
 
     mq_close(mq_end);
-    mq_close(mq_rng);
+    if (bc_destroy(draws))
+        ERR("munmap");
     if (mq_unlink("/bingo_mq_end"))
         ERR("mq_unlink");
-    if (mq_unlink("/bingo_mq_rng"))
-        ERR("mq_unlink");
     return EXIT_SUCCESS;
 }
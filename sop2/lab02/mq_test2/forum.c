@@ -9,7 +9,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "../sop_reactor.h"
+
 #define CHILD_COUNT 4
+#define REACTOR_THREADS 2
 
 #define QUEUE_NAME_MAX_LEN 32
 #define CHILD_NAME_MAX_LEN 32
@@ -41,24 +44,12 @@ typedef struct
     mqd_t queue;
 } child_data;
 
-void handle_messages(union sigval data);
-
-void register_notification(child_data* data)
-{
-    struct sigevent notification = {
-        .sigev_value.sival_ptr = data, .sigev_notify = SIGEV_THREAD, .sigev_notify_function = handle_messages};
-
-    int res = mq_notify(data->queue, &notification);
-    if (res == -1)
-        ERR("mq_notify");
-}
-
-void handle_messages(union sigval data)
+// Called from a thread of the reactor whenever the queue has messages, the queue is re-armed after it returns.
+void handle_messages(void* data, uint32_t events)
 {
-    child_data* child_data = data.sival_ptr;
+    (void)events;
+    child_data* child_data = data;
     char message[MSG_SIZE];
-    // again, register the notification again before we read the message
-    register_notification(child_data);
 
     for (;;)
     {
@@ -92,9 +83,13 @@ void child_work(char* name, mqd_t* queues, int i)
     printf("%s: A PID %d incipiens.\n", name, pid);
     srand(pid);
     child_data child_data = {.name = name, .queue = queues[i]};
-    union sigval data;
-    data.sival_ptr = &child_data;
-    handle_messages(data);
+    // the same threads handle every message, however many of them come at once
+    reactor_t reactor;
+    reactor_handler_t handler;
+    if (reactor_init(&reactor, REACTOR_THREADS))
+        ERR("reactor_init");
+    if (reactor_add(&reactor, &handler, queues[i], EPOLLIN, handle_messages, &child_data))
+        ERR("reactor_add");
 
     for (int i = 0; i < ROUNDS; ++i)
     {
@@ -118,10 +113,14 @@ void child_work(char* name, mqd_t* queues, int i)
     }
     printf("%s: Disceo.\n", name);
 
-    // IMPORTANT: we exit HERE, not after child_work (as we would usually)
-    // this is because the notification thread could still be using the child_data
-    // structure, so we can't let it get out of scope
-    exit(EXIT_SUCCESS);
+    // once the threads are joined nobody uses child_data or the queues any more
+    if (reactor_stop(&reactor))
+        ERR("reactor_stop");
+    for (int i = 0; i < CHILD_COUNT; i++)
+    {
+        if (mq_close(queues[i]) != 0)
+            ERR("mq_close");
+    }
 }
 
 void create_children(char names[][CHILD_NAME_MAX_LEN], mqd_t* queues, int n)
@@ -134,10 +133,7 @@ void create_children(char names[][CHILD_NAME_MAX_LEN], mqd_t* queues, int n)
         if (pid == 0)
         {
             child_work(names[i], queues, i);
-            // note: we DON'T close queues in children because we handle notifications
-            // on separate threads - and we know nothing about when these threads are running
-            // or when they die
-            // so we need to keep the queues open, the kernel will kill them on exit anyway
+            exit(EXIT_SUCCESS);
         }
     }
 }
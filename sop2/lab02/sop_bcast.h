@@ -0,0 +1,154 @@
+#ifndef SOP_BCAST_H
+#define SOP_BCAST_H
+
+// One-to-many broadcast of fixed-size records through shared memory.
+//
+// A single publisher appends records to a ring and bumps `generation`, the futex word all the subscribers sleep on,
+// so one FUTEX_WAKE wakes every one of them. Subscribers don't take records out of the ring, each of them only moves
+// its own cursor (the sequence number of the next record it wants), so every subscriber sees every record and
+// publishing costs the same for one subscriber as for a thousand.
+// The publisher never waits for anybody. A subscriber that falls more than `capacity` records behind loses the
+// overwritten ones: they are counted for it and it continues from the oldest record still in the ring. Every slot is
+// a seqlock (its sequence number is cleared while the publisher writes), which is how a slow reader notices that the
+// record it was copying has been overwritten.
+// The ring lives in anonymous shared memory, so it is shared by creating it before fork().
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BC_CACHE_LINE 64
+#define BC_EMPTY UINT64_MAX  // sequence number of a slot which is being written or hasn't been written yet
+#define BC_CLOSED 1          // bc_receive result, the publisher is gone and everything has been read
+
+typedef struct bc_slot
+{
+    _Atomic uint64_t seq;
+    char data[];
+} bc_slot_t;
+
+typedef struct bc_ring
+{
+    uint32_t capacity;
+    uint32_t mask;
+    uint32_t record_size;
+    uint32_t slot_size;
+    _Alignas(BC_CACHE_LINE) _Atomic uint64_t head;  // sequence number of the next record
+    _Atomic uint32_t generation;
+    _Atomic uint32_t waiters;
+    _Atomic uint32_t closed;
+    _Alignas(BC_CACHE_LINE) char slots[];
+} bc_ring_t;
+
+size_t bc_size(uint32_t capacity, uint32_t record_size)
+{
+    return sizeof(bc_ring_t) + (size_t)capacity * ((sizeof(bc_slot_t) + record_size + 7) & ~(size_t)7);
+}
+
+bc_slot_t *bc_slot(bc_ring_t *r, uint64_t seq) { return (bc_slot_t *)(r->slots + (seq & r->mask) * r->slot_size); }
+
+// Capacity is rounded up to a power of two. Returns NULL with errno set on failure.
+bc_ring_t *bc_create(uint32_t capacity, uint32_t record_size)
+{
+    uint32_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    void *mem = mmap(NULL, bc_size(cap, record_size), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    bc_ring_t *r = mem;
+    r->capacity = cap;
+    r->mask = cap - 1;
+    r->record_size = record_size;
+    r->slot_size = (sizeof(bc_slot_t) + record_size + 7) & ~(uint32_t)7;
+    for (uint32_t i = 0; i < cap; i++)
+        atomic_init(&bc_slot(r, i)->seq, BC_EMPTY);
+    return r;
+}
+
+int bc_destroy(bc_ring_t *r) { return munmap(r, bc_size(r->capacity, r->record_size)); }
+
+// Cursor of a new subscriber, it will get the records published from now on.
+uint64_t bc_subscribe(bc_ring_t *r) { return atomic_load(&r->head); }
+
+void bc_wake_all(bc_ring_t *r)
+{
+    atomic_fetch_add(&r->generation, 1);
+    // pairs with the increment of `waiters` before a subscriber looks at the generation for the last time
+    if (atomic_load(&r->waiters) > 0)
+        syscall(SYS_futex, &r->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Only one process may publish.
+void bc_publish(bc_ring_t *r, const void *record)
+{
+    uint64_t seq = atomic_load_explicit(&r->head, memory_order_relaxed);
+    bc_slot_t *slot = bc_slot(r, seq);
+    atomic_store_explicit(&slot->seq, BC_EMPTY, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(slot->data, record, r->record_size);
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&r->head, seq + 1, memory_order_release);
+    bc_wake_all(r);
+}
+
+// Subscribers get the records still in the ring and then BC_CLOSED.
+void bc_close(bc_ring_t *r)
+{
+    atomic_store(&r->closed, 1);
+    bc_wake_all(r);
+}
+
+// Copies the record at *cursor if it is still in the ring. Returns 0 on success, -1 if it has been overwritten.
+int bc_copy(bc_ring_t *r, uint64_t cursor, void *record)
+{
+    bc_slot_t *slot = bc_slot(r, cursor);
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != cursor)
+        return -1;
+    memcpy(record, slot->data, r->record_size);
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == cursor ? 0 : -1;
+}
+
+/**
+ * Copies the record at *cursor into `record` and moves the cursor past it, sleeping until it is published.
+ * Records overwritten before the subscriber got to them are skipped and added to *lost (if not NULL).
+ * @return 0, or BC_CLOSED once the ring is closed and the subscriber has read everything.
+ */
+int bc_receive(bc_ring_t *r, uint64_t *cursor, void *record, uint64_t *lost)
+{
+    for (;;)
+    {
+        uint32_t generation = atomic_load(&r->generation);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (*cursor < head)
+        {
+            if (head - *cursor > r->capacity || bc_copy(r, *cursor, record))
+            {
+                // the publisher has lapped us, jump to the oldest record it can't overwrite before we read it
+                uint64_t oldest = head > r->capacity ? head - r->capacity + 1 : 0;
+                if (oldest <= *cursor)
+                    oldest = *cursor + 1;
+                if (lost != NULL)
+                    *lost += oldest - *cursor;
+                *cursor = oldest;
+                continue;
+            }
+            (*cursor)++;
+            return 0;
+        }
+        if (atomic_load(&r->closed))
+            return BC_CLOSED;
+        atomic_fetch_add(&r->waiters, 1);
+        if (atomic_load(&r->generation) == generation)
+            syscall(SYS_futex, &r->generation, FUTEX_WAIT, generation, NULL, NULL, 0);
+        atomic_fetch_sub(&r->waiters, 1);
+    }
+}
+
+#endif
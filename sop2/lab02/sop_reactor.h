@@ -0,0 +1,132 @@
+#ifndef SOP_REACTOR_H
+#define SOP_REACTOR_H
+
+// A fixed pool of threads waiting in one epoll set and calling back whoever owns a descriptor which became ready.
+//
+// It replaces mq_notify(SIGEV_THREAD), where glibc starts a new thread for every notification and the handler has to
+// arm the notification again before it drains the queue. Here the threads are started once, a queue (or any other
+// pollable descriptor) is registered once, and a burst of messages costs no more threads than a single one.
+// Descriptors are armed with EPOLLONESHOT and re-armed after their callback returns, so a callback never runs in two
+// threads at once for the same descriptor and doesn't need a lock for its own state.
+// The pool threads block all signals, which are left to the thread that created the reactor.
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+typedef void (*reactor_cb_t)(void *arg, uint32_t events);
+
+typedef struct reactor_handler
+{
+    int fd;
+    uint32_t events;
+    reactor_cb_t cb;
+    void *arg;
+} reactor_handler_t;
+
+typedef struct reactor
+{
+    int epoll_fd;
+    int stop_fd;
+    int n_threads;
+    pthread_t *threads;
+} reactor_t;
+
+// Every thread takes one ready descriptor at a time, so a slow callback doesn't hold up the others which are ready.
+void *reactor_thread(void *data)
+{
+    reactor_t *r = data;
+    for (;;)
+    {
+        struct epoll_event event;
+        int ready = epoll_wait(r->epoll_fd, &event, 1, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return NULL;
+        }
+        reactor_handler_t *h = event.data.ptr;
+        // the stop eventfd is never read, so it wakes up every thread of the pool
+        if (h == NULL)
+            return NULL;
+        int fd = h->fd;
+        uint32_t events = event.events;
+        event.events = h->events | EPOLLONESHOT;
+        h->cb(h->arg, events);
+        // fails with ENOENT if the callback has removed its descriptor
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+}
+
+// Starts `n_threads` threads. Returns 0, or -1 with errno set.
+int reactor_init(reactor_t *r, int n_threads)
+{
+    r->n_threads = 0;
+    if ((r->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+    if ((r->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        return -1;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->stop_fd, &event))
+        return -1;
+    if ((r->threads = malloc(n_threads * sizeof(pthread_t))) == NULL)
+        return -1;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (; r->n_threads < n_threads; r->n_threads++)
+    {
+        int err = pthread_create(&r->threads[r->n_threads], NULL, reactor_thread, r);
+        if (err)
+        {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            errno = err;
+            return -1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+// Calls cb(arg, events) from one of the threads whenever `fd` is ready for `events`. The handler must stay valid
+// until reactor_stop, a callback running in another thread may still be using it after reactor_remove.
+int reactor_add(reactor_t *r, reactor_handler_t *h, int fd, uint32_t events, reactor_cb_t cb, void *arg)
+{
+    h->fd = fd;
+    h->events = events;
+    h->cb = cb;
+    h->arg = arg;
+    struct epoll_event event = {.events = events | EPOLLONESHOT, .data.ptr = h};
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int reactor_remove(reactor_t *r, reactor_handler_t *h) { return epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, h->fd, NULL); }
+
+// Waits for the callbacks in progress and joins the threads. Returns 0, or -1 with errno set.
+int reactor_stop(reactor_t *r)
+{
+    uint64_t one = 1;
+    if (write(r->stop_fd, &one, sizeof(one)) != sizeof(one))
+        return -1;
+    for (int i = 0; i < r->n_threads; i++)
+    {
+        int err = pthread_join(r->threads[i], NULL);
+        if (err)
+        {
+            errno = err;
+            return -1;
+        }
+    }
+    free(r->threads);
+    if (close(r->stop_fd) || close(r->epoll_fd))
+        return -1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,477 @@
+#ifndef SOP_TRANSPORT_H
+#define SOP_TRANSPORT_H
+
+// Message transport with interchangeable backends, picked at run time:
+//  - TR_MQ - a POSIX message queue, every message is a system call and a copy through the kernel,
+//  - TR_RING - a bounded multi-producer/multi-consumer ring of fixed-size slots in shared memory (D. Vyukov's
+//    sequence numbers, as in lab03/sop_mpmc.h), no system call at all unless somebody has to sleep.
+// Both keep message boundaries and a fixed capacity. The ring delivers priorities but doesn't reorder by them.
+//
+// Whether a call blocks is decided per call by its timeout (-1 - wait as long as needed, 0 - just try), not per open
+// description, so a single transport serves both a worker sleeping in tr_receive and an event loop draining it.
+// tr_fd returns a descriptor to wait on with poll/epoll, for data (TR_READABLE) or for room (TR_WRITABLE): the queue
+// itself for TR_MQ, one of two eventfds for TR_RING. tr_fd_events gives the events to wait for on it.
+//
+// Blocked ring users sleep on futexes in the ring: `data_seq` moves when a message lands in an empty ring (or when a
+// receiver takes a message and sees more of them while others sleep), `space_seq` when a slot is freed while a sender
+// waits for one. Both sides only make the wake-up call when somebody is counted as waiting, so a busy ring makes no
+// system calls. The eventfds of tr_fd are signalled on the same occasions, once an event loop has asked for them (the
+// room one only when the ring stops being full). Several processes may watch the same ring.
+// A ring lives in anonymous shared memory and its eventfds are plain descriptors, so it is shared by opening it before
+// fork(). Unrelated processes have to use TR_MQ, which is found by name.
+//
+// zad02 and zad03 run on it. zad04, mq_test1/bingo and mq_test2/forum still call mq_* directly: bingo is woken by
+// mq_notify signals and forum by a reactor re-arming the queue descriptors, neither of which a ring offers, and
+// zad04 connects unrelated processes, where only TR_MQ would do anyway.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TR_CACHE_LINE 64
+#define TR_CREAT 1  // tr_open flag, create the queue if it doesn't exist
+
+typedef enum
+{
+    TR_MQ,
+    TR_RING
+} tr_kind_t;
+
+typedef enum
+{
+    TR_READABLE,
+    TR_WRITABLE
+} tr_dir_t;
+
+typedef struct tr_slot
+{
+    _Atomic uint64_t seq;
+    uint32_t len;
+    uint32_t prio;
+    char data[];
+} tr_slot_t;
+
+typedef struct tr_ring
+{
+    uint64_t capacity;
+    uint64_t mask;
+    uint64_t slot_size;
+    _Alignas(TR_CACHE_LINE) _Atomic uint64_t enqueue_pos;
+    _Alignas(TR_CACHE_LINE) _Atomic uint64_t dequeue_pos;
+    _Alignas(TR_CACHE_LINE) _Atomic uint32_t data_seq;
+    _Atomic uint32_t space_seq;
+    _Atomic uint32_t receivers_waiting;
+    _Atomic uint32_t senders_waiting;
+    _Atomic uint32_t watchers;  // processes which wait on the data eventfd
+    _Atomic uint32_t space_watchers;  // processes which wait on the space eventfd
+    _Alignas(TR_CACHE_LINE) unsigned char slots[];
+} tr_ring_t;
+
+typedef struct transport
+{
+    tr_kind_t kind;
+    uint32_t msg_size;
+    mqd_t mq;
+    tr_ring_t *ring;
+    size_t ring_size;
+    int data_fd;
+    int space_fd;
+    pid_t watcher;  // the process which called tr_fd, a forked child doesn't inherit the role
+    pid_t space_watcher;  // the same for tr_fd(TR_WRITABLE)
+} transport_t;
+
+// Parses "mq" or "ring". Returns 0, or -1 for anything else.
+int tr_parse_kind(const char *name, tr_kind_t *kind)
+{
+    if (strcmp(name, "mq") == 0)
+        *kind = TR_MQ;
+    else if (strcmp(name, "ring") == 0)
+        *kind = TR_RING;
+    else
+        return -1;
+    return 0;
+}
+
+const char *tr_kind_name(tr_kind_t kind) { return kind == TR_MQ ? "mq" : "ring"; }
+
+tr_slot_t *tr_slot(tr_ring_t *r, uint64_t pos) { return (tr_slot_t *)(r->slots + (pos & r->mask) * r->slot_size); }
+
+int64_t tr_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Opens a transport for messages of up to `msg_size` bytes, holding at most `msg_count` of them (a ring rounds it up
+ * to a power of two). TR_MQ queues are looked up by `name` and created with TR_CREAT. TR_RING has no name, it's
+ * always created and shared with the children forked afterwards.
+ * @return 0, or -1 with errno set.
+ */
+int tr_open(transport_t *t, tr_kind_t kind, const char *name, int flags, uint32_t msg_count, uint32_t msg_size)
+{
+    memset(t, 0, sizeof(transport_t));
+    t->kind = kind;
+    t->msg_size = msg_size;
+    t->data_fd = -1;
+    t->space_fd = -1;
+    if (msg_count == 0 || msg_size == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (kind == TR_MQ)
+    {
+        struct mq_attr attr = {.mq_maxmsg = msg_count, .mq_msgsize = msg_size};
+        t->mq = mq_open(name, O_RDWR | (flags & TR_CREAT ? O_CREAT : 0), 0600, &attr);
+        return t->mq == (mqd_t)-1 ? -1 : 0;
+    }
+
+    uint64_t capacity = 1;
+    while (capacity < msg_count)
+        capacity <<= 1;
+    uint64_t slot_size = (sizeof(tr_slot_t) + msg_size + 7) & ~7ULL;
+    t->ring_size = sizeof(tr_ring_t) + capacity * slot_size;
+    void *ptr = mmap(NULL, t->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return -1;
+    t->ring = ptr;
+    t->ring->capacity = capacity;
+    t->ring->mask = capacity - 1;
+    t->ring->slot_size = slot_size;
+    for (uint64_t i = 0; i < capacity; i++)
+        atomic_init(&tr_slot(t->ring, i)->seq, i);
+    if ((t->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        (t->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        int err = errno;
+        if (t->data_fd >= 0)
+            close(t->data_fd);
+        munmap(t->ring, t->ring_size);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Closes the transport in the calling process. Returns 0, or -1 with errno set.
+int tr_close(transport_t *t)
+{
+    if (t->kind == TR_MQ)
+        return mq_close(t->mq);
+    int err = 0;
+    if (t->watcher == getpid())
+        atomic_fetch_sub(&t->ring->watchers, 1);
+    if (t->space_watcher == getpid())
+        atomic_fetch_sub(&t->ring->space_watchers, 1);
+    if (close(t->data_fd) < 0 || close(t->space_fd) < 0)
+        err = errno;
+    if (munmap(t->ring, t->ring_size) < 0)
+        err = errno;
+    errno = err;
+    return err ? -1 : 0;
+}
+
+// Removes the name of a TR_MQ queue, a ring disappears with the last process which has it open.
+int tr_unlink(tr_kind_t kind, const char *name) { return kind == TR_MQ ? mq_unlink(name) : 0; }
+
+// Number of messages waiting in the transport (a snapshot, others may be changing it). Returns -1 on error.
+long tr_pending(transport_t *t)
+{
+    if (t->kind == TR_MQ)
+    {
+        struct mq_attr attr;
+        return mq_getattr(t->mq, &attr) < 0 ? -1 : attr.mq_curmsgs;
+    }
+    int64_t n = (int64_t)(atomic_load(&t->ring->enqueue_pos) - atomic_load(&t->ring->dequeue_pos));
+    return n < 0 ? 0 : n;
+}
+
+void tr_signal(int fd)
+{
+    uint64_t one = 1;
+    // EAGAIN only if the counter is about to overflow, then it is signalled anyway
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        abort();
+}
+
+void tr_clear(int fd)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        abort();
+}
+
+/**
+ * Descriptor which becomes ready when messages may be waiting (TR_READABLE) or when a full transport may have room
+ * again (TR_WRITABLE). Drain the transport, or retry the send, with a zero timeout after that.
+ */
+int tr_fd(transport_t *t, tr_dir_t dir)
+{
+    if (t->kind == TR_MQ)
+        return t->mq;
+    if (dir == TR_WRITABLE)
+    {
+        if (t->space_watcher != getpid())
+        {
+            t->space_watcher = getpid();
+            atomic_fetch_add(&t->ring->space_watchers, 1);
+            tr_signal(t->space_fd);
+        }
+        return t->space_fd;
+    }
+    if (t->watcher != getpid())
+    {
+        t->watcher = getpid();
+        atomic_fetch_add(&t->ring->watchers, 1);
+        // messages sent before nobody signalled the eventfd, the first wait has to look at the ring anyway
+        tr_signal(t->data_fd);
+    }
+    return t->data_fd;
+}
+
+// poll/epoll events to wait for on tr_fd(t, dir): a queue is writable, an eventfd readable. EPOLLx == POLLx.
+uint32_t tr_fd_events(transport_t *t, tr_dir_t dir)
+{
+    return t->kind == TR_MQ && dir == TR_WRITABLE ? POLLOUT : POLLIN;
+}
+
+// Sleeps while *word == val, up to `deadline` (tr_now_ms, -1 for no deadline). Returns 0 when woken up or when the
+// word has changed already, or -1 with errno EAGAIN at the deadline or EINTR.
+int tr_futex_wait(_Atomic uint32_t *word, uint32_t val, int64_t deadline)
+{
+    struct timespec ts, *timeout = NULL;
+    if (deadline >= 0)
+    {
+        int64_t left = deadline - tr_now_ms();
+        if (left <= 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        ts.tv_sec = left / 1000;
+        ts.tv_nsec = (left % 1000) * 1000000L;
+        timeout = &ts;
+    }
+    if (syscall(SYS_futex, word, FUTEX_WAIT, val, timeout, NULL, 0) == 0 || errno == EAGAIN)
+        return 0;
+    if (errno == ETIMEDOUT)
+        errno = EAGAIN;
+    return -1;
+}
+
+void tr_futex_wake(_Atomic uint32_t *word)
+{
+    atomic_fetch_add(word, 1);
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Wakes up a blocked receiver (other than the caller, if it's `waiting` itself) and the event loops.
+void tr_notify_data(transport_t *t, int waiting)
+{
+    if (atomic_load(&t->ring->receivers_waiting) > (uint32_t)waiting)
+        tr_futex_wake(&t->ring->data_seq);
+    if (atomic_load(&t->ring->watchers) > 0)
+        tr_signal(t->data_fd);
+}
+
+int tr_ring_try_send(transport_t *t, const void *msg, size_t len, unsigned prio)
+{
+    tr_ring_t *r = t->ring;
+    uint64_t pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    tr_slot_t *slot;
+    for (;;)
+    {
+        slot = tr_slot(r, pos);
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0 && atomic_compare_exchange_weak(&r->enqueue_pos, &pos, pos + 1))
+            break;
+        if (diff < 0)
+            return -1;
+        if (diff > 0)
+            pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    }
+    memcpy(slot->data, msg, len);
+    slot->len = len;
+    slot->prio = prio;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    // the ring was empty, receivers may be asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&r->dequeue_pos) == pos)
+        tr_notify_data(t, 0);
+    return 0;
+}
+
+// `waiting` - the caller is counted in receivers_waiting itself.
+ssize_t tr_ring_try_receive(transport_t *t, void *buf, unsigned *prio, int waiting)
+{
+    tr_ring_t *r = t->ring;
+    uint64_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    tr_slot_t *slot;
+    for (;;)
+    {
+        slot = tr_slot(r, pos);
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - (pos + 1));
+        if (diff == 0 && atomic_compare_exchange_weak(&r->dequeue_pos, &pos, pos + 1))
+            break;
+        if (diff < 0)
+            return -1;
+        if (diff > 0)
+            pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    }
+    ssize_t len = slot->len;
+    memcpy(buf, slot->data, len);
+    if (prio != NULL)
+        *prio = slot->prio;
+    atomic_store_explicit(&slot->seq, pos + r->capacity, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&r->senders_waiting) > 0)
+        tr_futex_wake(&r->space_seq);
+    // a send can only have failed on this very slot, and only if nothing was sent since
+    if (atomic_load(&r->space_watchers) > 0 && atomic_load(&r->enqueue_pos) == pos + r->capacity)
+        tr_signal(t->space_fd);
+    // only the first message of a burst is signalled, pass the wakeup on to the other sleeping receivers
+    if (atomic_load(&r->receivers_waiting) > (uint32_t)waiting && atomic_load(&r->enqueue_pos) != pos + 1)
+        tr_futex_wake(&r->data_seq);
+    return len;
+}
+
+int tr_ring_send(transport_t *t, const void *msg, size_t len, unsigned prio, int64_t deadline)
+{
+    if (tr_ring_try_send(t, msg, len, prio) == 0)
+        return 0;
+    if (deadline == 0)
+    {
+        // an event loop waits on the space eventfd next, it must not stay readable with the ring full
+        if (t->space_watcher == getpid())
+        {
+            tr_clear(t->space_fd);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (tr_ring_try_send(t, msg, len, prio) == 0)
+            {
+                // the signal just cleared may have been meant for another watcher too
+                if (tr_pending(t) < (long)t->ring->capacity)
+                    tr_signal(t->space_fd);
+                return 0;
+            }
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    // once counted as waiting, every freed slot moves space_seq, so the look at the ring and the sleep can't miss one
+    atomic_fetch_add(&t->ring->senders_waiting, 1);
+    int ret;
+    for (;;)
+    {
+        uint32_t seq = atomic_load(&t->ring->space_seq);
+        if ((ret = tr_ring_try_send(t, msg, len, prio)) == 0 ||
+            (ret = tr_futex_wait(&t->ring->space_seq, seq, deadline)) < 0)
+            break;
+    }
+    int err = errno;
+    atomic_fetch_sub(&t->ring->senders_waiting, 1);
+    errno = err;
+    return ret;
+}
+
+ssize_t tr_ring_receive(transport_t *t, void *buf, unsigned *prio, int64_t deadline)
+{
+    ssize_t len;
+    if ((len = tr_ring_try_receive(t, buf, prio, 0)) >= 0)
+        return len;
+    if (deadline == 0)
+    {
+        // an event loop waits on the eventfd next, it must not stay readable with the ring empty
+        tr_clear(t->data_fd);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((len = tr_ring_try_receive(t, buf, prio, 0)) < 0)
+            errno = EAGAIN;
+        // the signal just cleared may have been meant for another watcher too, pass it on if there is more
+        else if (tr_pending(t) > 0)
+            tr_signal(t->data_fd);
+        return len;
+    }
+    atomic_fetch_add(&t->ring->receivers_waiting, 1);
+    for (;;)
+    {
+        uint32_t seq = atomic_load(&t->ring->data_seq);
+        if ((len = tr_ring_try_receive(t, buf, prio, 1)) >= 0 ||
+            (len = tr_futex_wait(&t->ring->data_seq, seq, deadline)) < 0)
+            break;
+    }
+    int err = errno;
+    atomic_fetch_sub(&t->ring->receivers_waiting, 1);
+    errno = err;
+    return len;
+}
+
+int64_t tr_deadline(int timeout_ms) { return timeout_ms < 0 ? -1 : timeout_ms == 0 ? 0 : tr_now_ms() + timeout_ms; }
+
+struct timespec tr_abstime(int timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    return ts;
+}
+
+/**
+ * Sends a message of `len` <= msg_size bytes, waiting up to `timeout_ms` for room (-1 - as long as needed).
+ * @return 0, or -1 with errno set: EAGAIN if the transport stayed full, EMSGSIZE, EINTR...
+ */
+int tr_send(transport_t *t, const void *msg, size_t len, unsigned prio, int timeout_ms)
+{
+    if (len > t->msg_size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (t->kind == TR_RING)
+        return tr_ring_send(t, msg, len, prio, tr_deadline(timeout_ms));
+    if (timeout_ms < 0)
+        return mq_send(t->mq, msg, len, prio);
+    struct timespec ts = tr_abstime(timeout_ms);
+    int ret = mq_timedsend(t->mq, msg, len, prio, &ts);
+    if (ret < 0 && errno == ETIMEDOUT)
+        errno = EAGAIN;
+    return ret;
+}
+
+/**
+ * Receives a message into `buf` of `size` >= msg_size bytes, waiting up to `timeout_ms` for one (-1 - as long as
+ * needed). The priority goes to *prio unless it's NULL.
+ * @return Length of the message, or -1 with errno set: EAGAIN if nothing came, EMSGSIZE, EINTR...
+ */
+ssize_t tr_receive(transport_t *t, void *buf, size_t size, unsigned *prio, int timeout_ms)
+{
+    if (size < t->msg_size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (t->kind == TR_RING)
+        return tr_ring_receive(t, buf, prio, tr_deadline(timeout_ms));
+    if (timeout_ms < 0)
+        return mq_receive(t->mq, buf, size, prio);
+    struct timespec ts = tr_abstime(timeout_ms);
+    ssize_t len = mq_timedreceive(t->mq, buf, size, prio, &ts);
+    if (len < 0 && errno == ETIMEDOUT)
+        errno = EAGAIN;
+    return len;
+}
+
+#endif
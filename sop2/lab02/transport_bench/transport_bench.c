@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../sop_transport.h"
+
+#define ERR(source) \
+    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+#define MAXN 256
+#define MAX_MSG_SIZE 8192
+#define DEFAULT_DEPTH 10
+#define DEFAULT_SIZE 64
+#define DEFAULT_MESSAGES 200000
+#define ROUND_TRIPS 20000
+
+typedef struct bench_opts
+{
+    int producers;
+    int consumers;
+    uint32_t size;
+    uint32_t depth;
+    int messages;
+} bench_opts;
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime");
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void open_queue(transport_t *queue, tr_kind_t kind, char *name, char *role, bench_opts *opts)
+{
+    sprintf(name, "/tr_bench_%d_%s", getpid(), role);
+    if (tr_unlink(kind, name) && errno != ENOENT)
+        ERR("tr_unlink");
+    if (tr_open(queue, kind, name, TR_CREAT, opts->depth, opts->size))
+        ERR("tr_open");
+}
+
+void remove_queue(transport_t *queue, tr_kind_t kind, char *name)
+{
+    if (tr_close(queue))
+        ERR("tr_close");
+    if (tr_unlink(kind, name))
+        ERR("tr_unlink");
+}
+
+// Children wait for the parent to close the write end of the pipe, so that forking isn't measured.
+void wait_for_start(int start_fd)
+{
+    char c;
+    if (TEMP_FAILURE_RETRY(read(start_fd, &c, 1)) < 0)
+        ERR("read");
+    if (close(start_fd))
+        ERR("close");
+}
+
+void producer_work(transport_t *queue, int start_fd, int messages, uint32_t size)
+{
+    char msg[MAX_MSG_SIZE];
+    memset(msg, 'x', size);
+    wait_for_start(start_fd);
+    for (int i = 0; i < messages; i++)
+        if (TEMP_FAILURE_RETRY(tr_send(queue, msg, size, 0, -1)) < 0)
+            ERR("tr_send");
+}
+
+// An empty message ends the work of a consumer. The exit status tells whether all the messages had the right length.
+int consumer_work(transport_t *queue, int start_fd, uint32_t size)
+{
+    char msg[MAX_MSG_SIZE];
+    wait_for_start(start_fd);
+    for (;;)
+    {
+        ssize_t len = TEMP_FAILURE_RETRY(tr_receive(queue, msg, MAX_MSG_SIZE, NULL, -1));
+        if (len < 0)
+            ERR("tr_receive");
+        if (len == 0)
+            return EXIT_SUCCESS;
+        if ((uint32_t)len != size)
+            return EXIT_FAILURE;
+    }
+}
+
+pid_t fork_worker(transport_t *queue, int start[2], int producer, int messages, uint32_t size)
+{
+    pid_t pid;
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+        ERR("fork");
+    if (pid == 0)
+    {
+        if (close(start[1]))
+            ERR("close");
+        int status = EXIT_SUCCESS;
+        if (producer)
+            producer_work(queue, start[0], messages, size);
+        else
+            status = consumer_work(queue, start[0], size);
+        if (tr_close(queue))
+            ERR("tr_close");
+        exit(status);
+    }
+    return pid;
+}
+
+/**
+ * Producers push `messages` messages in total through one transport, consumers take them out.
+ * @return Messages per second, from the start signal until the last consumer is done.
+ */
+double bench_throughput(tr_kind_t kind, bench_opts *opts)
+{
+    char name[MAXN];
+    transport_t queue;
+    open_queue(&queue, kind, name, "flow", opts);
+    int start[2];
+    if (pipe(start))
+        ERR("pipe");
+    pid_t *producers = malloc(opts->producers * sizeof(pid_t));
+    if (producers == NULL)
+        ERR("malloc");
+    for (int i = 0; i < opts->producers; i++)
+    {
+        int share = opts->messages / opts->producers + (i < opts->messages % opts->producers);
+        producers[i] = fork_worker(&queue, start, 1, share, opts->size);
+    }
+    for (int i = 0; i < opts->consumers; i++)
+        fork_worker(&queue, start, 0, 0, opts->size);
+    if (close(start[0]))
+        ERR("close");
+
+    uint64_t begin = now_ns();
+    if (close(start[1]))
+        ERR("close");
+    for (int i = 0; i < opts->producers; i++)
+        if (TEMP_FAILURE_RETRY(waitpid(producers[i], NULL, 0)) < 0)
+            ERR("waitpid");
+    for (int i = 0; i < opts->consumers; i++)
+        if (TEMP_FAILURE_RETRY(tr_send(&queue, name, 0, 0, -1)) < 0)
+            ERR("tr_send");
+    int status, failed = 0;
+    while (wait(&status) > 0)
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    uint64_t elapsed = now_ns() - begin;
+    if (failed)
+    {
+        fprintf(stderr, "a consumer got a message of a wrong size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(producers);
+    remove_queue(&queue, kind, name);
+    return opts->messages * 1e9 / elapsed;
+}
+
+/**
+ * A message bounces between the parent and a child through two transports.
+ * @return Average round trip in microseconds.
+ */
+double bench_latency(tr_kind_t kind, bench_opts *opts)
+{
+    char ping_name[MAXN], pong_name[MAXN];
+    transport_t ping, pong;
+    open_queue(&ping, kind, ping_name, "ping", opts);
+    open_queue(&pong, kind, pong_name, "pong", opts);
+    char msg[MAX_MSG_SIZE];
+    memset(msg, 'x', opts->size);
+
+    pid_t pid;
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+        ERR("fork");
+    if (pid == 0)
+    {
+        ssize_t len;
+        while ((len = TEMP_FAILURE_RETRY(tr_receive(&ping, msg, MAX_MSG_SIZE, NULL, -1))) > 0)
+            if (TEMP_FAILURE_RETRY(tr_send(&pong, msg, len, 0, -1)) < 0)
+                ERR("tr_send");
+        if (len < 0)
+            ERR("tr_receive");
+        if (tr_close(&ping) || tr_close(&pong))
+            ERR("tr_close");
+        exit(EXIT_SUCCESS);
+    }
+
+    uint64_t begin = now_ns();
+    for (int i = 0; i < ROUND_TRIPS; i++)
+    {
+        if (TEMP_FAILURE_RETRY(tr_send(&ping, msg, opts->size, 0, -1)) < 0)
+            ERR("tr_send");
+        if (TEMP_FAILURE_RETRY(tr_receive(&pong, msg, MAX_MSG_SIZE, NULL, -1)) < 0)
+            ERR("tr_receive");
+    }
+    uint64_t elapsed = now_ns() - begin;
+    if (TEMP_FAILURE_RETRY(tr_send(&ping, msg, 0, 0, -1)) < 0)
+        ERR("tr_send");
+    if (TEMP_FAILURE_RETRY(waitpid(pid, NULL, 0)) < 0)
+        ERR("waitpid");
+
+    remove_queue(&ping, kind, ping_name);
+    remove_queue(&pong, kind, pong_name);
+    return elapsed / 1e3 / ROUND_TRIPS;
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-t mq|ring] [-p producers] [-c consumers] [-s size] [-q depth] [-n messages]\n",
+            name);
+    fprintf(stderr, "-t - transport to measure, default both\n");
+    fprintf(stderr, "-p, -c - number of producer and consumer processes, default 1\n");
+    fprintf(stderr, "1 <= size <= %d - message size in bytes, default %d\n", MAX_MSG_SIZE, DEFAULT_SIZE);
+    fprintf(stderr, "depth - capacity of the transport in messages, default %d (mq: up to /proc/sys/fs/mqueue/msg_max)\n",
+            DEFAULT_DEPTH);
+    fprintf(stderr, "messages - messages sent in the throughput test, default %d\n", DEFAULT_MESSAGES);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts opts = {
+        .producers = 1, .consumers = 1, .size = DEFAULT_SIZE, .depth = DEFAULT_DEPTH, .messages = DEFAULT_MESSAGES};
+    int kinds[] = {TR_MQ, TR_RING}, n_kinds = 2, c;
+    tr_kind_t kind;
+    while ((c = getopt(argc, argv, "t:p:c:s:q:n:")) != -1)
+    {
+        switch (c)
+        {
+            case 't':
+                if (tr_parse_kind(optarg, &kind))
+                    usage(argv[0]);
+                kinds[0] = kind;
+                n_kinds = 1;
+                break;
+            case 'p':
+                opts.producers = atoi(optarg);
+                break;
+            case 'c':
+                opts.consumers = atoi(optarg);
+                break;
+            case 's':
+                opts.size = atoi(optarg);
+                break;
+            case 'q':
+                opts.depth = atoi(optarg);
+                break;
+            case 'n':
+                opts.messages = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc != optind || opts.producers <= 0 || opts.consumers <= 0 || opts.size == 0 || opts.size > MAX_MSG_SIZE ||
+        opts.depth == 0 || opts.messages <= 0)
+        usage(argv[0]);
+
+    printf("%d producers, %d consumers, %u B messages, depth %u\n", opts.producers, opts.consumers, opts.size,
+           opts.depth);
+    for (int i = 0; i < n_kinds; i++)
+    {
+        double rate = bench_throughput(kinds[i], &opts);
+        double rtt = bench_latency(kinds[i], &opts);
+        printf("%-4s: %10.0f msg/s %8.1f MB/s, round trip %6.2f us\n", tr_kind_name(kinds[i]), rate,
+               rate * opts.size / 1e6, rtt);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,39 +1,45 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
-#include <mqueue.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../sop_transport.h"
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 #define MAXN 256
 #define MAX_MSG_COUNT 10
 #define MAX_MSG_SIZE 4096
 #define N_TASKS 2
+#define FLUSH_MS 10
+#define LATENCY_WEIGHT 0.2
 
 typedef struct task_data
 {
+    uint32_t id;
     double v1;
     double v2;
 } task_data;
 
-int set_handler(void (*f)(int, siginfo_t *, void *), int signo)
+typedef struct task_result
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof(struct sigaction));
-    act.sa_sigaction = f;
-    act.sa_flags = SA_SIGINFO;
-    if (sigaction(signo, &act, NULL) == -1)
-        return -1;
-    return 0;
-}
+    uint32_t id;
+    uint32_t owner;  // worker the task was assigned to, differs from the sender for stolen tasks
+    uint32_t ms;  // how long the task took
+    double v;
+} task_result;
+
+// Tasks and results travel in batches, a message is an array of them. An empty task message tells a worker to stop.
+#define TASK_BATCH (MAX_MSG_SIZE / sizeof(task_data))
+#define RESULT_BATCH (MAX_MSG_SIZE / sizeof(task_result))
 
 void msleep(int msec)
 {
@@ -46,183 +52,547 @@ void msleep(int msec)
         ERR("nanosleep");
 }
 
-mqd_t open_mq(char *name, int flags)
+void open_queue(transport_t *queue, tr_kind_t kind, char *name)
 {
-    struct mq_attr mq_attr = {};
-    mq_attr.mq_maxmsg = MAX_MSG_COUNT;
-    mq_attr.mq_msgsize = MAX_MSG_SIZE;
-    mqd_t mq = mq_open(name, flags, 0600, &mq_attr);
-    if (mq == -1)
-        ERR("mq_open");
-    return mq;
+    if (tr_open(queue, kind, name, TR_CREAT, MAX_MSG_COUNT, MAX_MSG_SIZE))
+        ERR("tr_open");
 }
 
-void mq_handler(int sig, siginfo_t *info, void *p);
+void close_queue(transport_t *queue)
+{
+    if (tr_close(queue))
+        ERR("tr_close");
+}
 
-void setup_notif(mqd_t *mq)
+int64_t now_ms(void)
 {
-    set_handler(mq_handler, SIGRTMIN);
-    static struct sigevent notif;
-    notif.sigev_notify = SIGEV_SIGNAL;
-    notif.sigev_signo = SIGRTMIN;
-    notif.sigev_value.sival_ptr = mq;
-    if (mq_notify(*mq, &notif) < 0)
-        ERR("mq_notify");
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime");
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-volatile sig_atomic_t results_received = 0;
+void task_queue_name(char *name, int server_pid, int worker) { sprintf(name, "/mq_%d_%d", server_pid, worker); }
+
+void result_queue_name(char *name, int server_pid, int worker) { sprintf(name, "/mq_res_%d_%d", server_pid, worker); }
 
-void mq_handler(int sig, siginfo_t *info, void *p)
+/**
+ * Receives all the results waiting in a result queue.
+ * The dispatcher passes `outstanding` and `avg_ms` to learn which workers are done with their tasks and how fast
+ * they are, the shared queue mode passes NULL.
+ */
+int drain_results(transport_t *queue, int worker, int *outstanding, double *avg_ms)
 {
-    (void)sig;
-    (void)p;
-    mqd_t *mq = (mqd_t *)info->si_value.sival_ptr;
-    setup_notif(mq);
     unsigned who;
-    double v;
+    task_result results[RESULT_BATCH];
+    int received = 0;
+    for (;;)
+    {
+        ssize_t len = tr_receive(queue, results, MAX_MSG_SIZE, &who, 0);
+        if (len == -1)
+        {
+            if (errno == EAGAIN)
+                return received;
+            ERR("tr_receive");
+        }
+        int count = len / sizeof(task_result);
+        for (int i = 0; i < count; i++)
+        {
+            printf("Result of task %u from worker [%d]: %.2f\n", results[i].id, who, results[i].v);
+            if (outstanding != NULL)
+            {
+                outstanding[results[i].owner]--;
+                double ms = results[i].ms;
+                avg_ms[worker] = avg_ms[worker] == 0 ? ms : (1 - LATENCY_WEIGHT) * avg_ms[worker] + LATENCY_WEIGHT * ms;
+            }
+        }
+        received += count;
+    }
+}
+
+void flush_results(transport_t *res_mq, task_result *results, int *count)
+{
+    if (*count == 0)
+        return;
+    if (TEMP_FAILURE_RETRY(tr_send(res_mq, results, *count * sizeof(task_result), (unsigned)getpid(), -1)) == -1)
+        ERR("tr_send");
+    *count = 0;
+}
+
+task_result do_task(task_data *task, int owner, int task_ms)
+{
+    int64_t start = now_ms();
+    printf("[%d] Received task %u [%.2f, %.2f]\n", getpid(), task->id, task->v1, task->v2);
+    if (task_ms < 0)
+        msleep(rand() % 1500 + 500);
+    else if (task_ms > 0)
+        msleep(rand() % task_ms);
+    return (task_result){.id = task->id, .owner = owner, .ms = now_ms() - start, .v = task->v1 + task->v2};
+}
+
+void child_work(int id, transport_t *server_mq, transport_t *res_mq, int task_ms)
+{
+    int pid = getpid();
+    srand(pid);
+    printf("[%d] Worker ready!\n", pid);
+    task_data tasks[TASK_BATCH];
+    task_result results[RESULT_BATCH];
+    int batched = 0, tasks_done = 0;
+    int64_t flush_at = 0;
 
     for (;;)
     {
-        int res = mq_receive(*mq, (char *)&v, MAX_MSG_SIZE, &who);
-        if (res != -1)
+        ssize_t len = TEMP_FAILURE_RETRY(tr_receive(server_mq, tasks, MAX_MSG_SIZE, NULL, -1));
+        if (len == -1)
+            ERR("tr_receive");
+        int count = len / sizeof(task_data);
+        if (count == 0)
+            break;
+        for (int i = 0; i < count; i++)
         {
-            printf("Result from worker [%d]: %.2f\n", who, v);
-            results_received++;
+            results[batched++] = do_task(&tasks[i], id, task_ms);
+            if (batched == 1)
+                flush_at = now_ms() + FLUSH_MS;
+            if (batched == (int)RESULT_BATCH || now_ms() >= flush_at)
+                flush_results(res_mq, results, &batched);
+            tasks_done++;
         }
-        else
+        // nothing is left to do, don't keep the results while waiting for more tasks
+        flush_results(res_mq, results, &batched);
+    }
+    printf("[%d] Worker done after %d tasks!\n", pid, tasks_done);
+}
+
+/**
+ * Takes the next task from the worker's own queue or, when it is empty, steals one from the deepest peer queue which
+ * has something. Sleeps in `epfd`, which watches the own queue and the peer queues that haven't been stopped yet.
+ * @return Length of the message, 0 for the stop message. *from is the worker the task was assigned to.
+ */
+ssize_t take_task(int epfd, transport_t *task_queues, int id, task_data *task, int *from)
+{
+    char buf[MAX_MSG_SIZE];
+    for (;;)
+    {
+        ssize_t len = tr_receive(&task_queues[id], buf, MAX_MSG_SIZE, NULL, 0);
+        if (len >= 0)
         {
-            if (errno == EAGAIN)
+            memcpy(task, buf, len);
+            *from = id;
+            return len;
+        }
+        if (errno != EAGAIN)
+            ERR("tr_receive");
+
+        struct epoll_event events[MAXN];
+        int ready = epoll_wait(epfd, events, MAXN, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        int victim = -1;
+        long deepest = 0;
+        for (int i = 0; i < ready; i++)
+        {
+            int j = events[i].data.u32;
+            long pending;
+            if (j == id)
+            {
+                // the own queue comes first
+                victim = -1;
                 break;
-            else
-                ERR("mq_receive");
+            }
+            if ((pending = tr_pending(&task_queues[j])) < 0)
+                ERR("tr_pending");
+            // an empty one is still tried, a failed receive takes the stale readiness off it
+            if (victim < 0 || pending > deepest)
+            {
+                deepest = pending;
+                victim = j;
+            }
+        }
+        if (victim < 0)
+            continue;
+        len = tr_receive(&task_queues[victim], buf, MAX_MSG_SIZE, NULL, 0);
+        if (len > 0)
+        {
+            memcpy(task, buf, len);
+            *from = victim;
+            return len;
+        }
+        if (len == 0)
+        {
+            // the stop message of the peer, give it back, nothing else will come to that queue
+            if (TEMP_FAILURE_RETRY(tr_send(&task_queues[victim], buf, 0, 0, -1)) == -1)
+                ERR("tr_send");
+            if (epoll_ctl(epfd, EPOLL_CTL_DEL, tr_fd(&task_queues[victim], TR_READABLE), NULL))
+                ERR("epoll_ctl");
         }
+        else if (errno != EAGAIN)
+            ERR("tr_receive");
     }
 }
 
-void child_work(mqd_t *server_mq, mqd_t *res_mq)
+// Worker of the dispatcher mode: every worker has its own task queue, idle workers steal from the others.
+void child_dispatch_work(int id, int n, transport_t *task_queues, transport_t *res_mq, int task_ms)
 {
     int pid = getpid();
     srand(pid);
     printf("[%d] Worker ready!\n", pid);
-    task_data data;
 
-    int tasks_done = 0;
-    for (;;)
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        ERR("epoll_create1");
+    struct epoll_event ev = {.events = EPOLLIN};
+    for (int i = 0; i < n; i++)
     {
-        for (;;)
+        ev.data.u32 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, tr_fd(&task_queues[i], TR_READABLE), &ev))
+            ERR("epoll_ctl");
+    }
+
+    int tasks_done = 0, stolen = 0, from;
+    task_data task;
+    while (take_task(epfd, task_queues, id, &task, &from) > 0)
+    {
+        task_result result = do_task(&task, from, task_ms);
+        // the dispatcher balances on the results, so they are not held back for batching
+        if (TEMP_FAILURE_RETRY(tr_send(res_mq, &result, sizeof(task_result), (unsigned)pid, -1)) == -1)
+            ERR("tr_send");
+        tasks_done++;
+        stolen += from != id;
+    }
+    if (close(epfd))
+        ERR("close");
+    printf("[%d] Worker done after %d tasks (%d stolen)!\n", pid, tasks_done, stolen);
+}
+
+int task_delay(int t1, int t2) { return t2 > t1 ? t1 + rand() % (t2 - t1) : t1; }
+
+/**
+ * Queues `tasks` tasks every t1..t2 ms and collects their results.
+ * Tasks are sent in batches, flushed when full or FLUSH_MS after the first task of the batch was created.
+ * One epoll set waits for the result queues and for the next deadline. While the task queue is full it also waits for
+ * room in it, the batch isn't offered again before that.
+ */
+void server_work(transport_t *server_mq, transport_t *queues, int n, int tasks, int t1, int t2)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        ERR("epoll_create1");
+    struct epoll_event ev = {.events = EPOLLIN};
+    for (int i = 0; i < n; i++)
+    {
+        ev.data.u32 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, tr_fd(&queues[i], TR_READABLE), &ev))
+            ERR("epoll_ctl");
+    }
+    // the task queue is only watched while a batch waits for room in it
+    struct epoll_event room = {.events = tr_fd_events(server_mq, TR_WRITABLE), .data.u32 = n};
+    int room_fd = tr_fd(server_mq, TR_WRITABLE);
+
+    task_data batch[TASK_BATCH];
+    int produced = 0, results_received = 0, batched = 0, waiting = 0;
+    int64_t next_task = now_ms() + task_delay(t1, t2), flush_at = 0;
+    while (results_received < tasks)
+    {
+        int64_t now = now_ms();
+        if (produced < tasks && batched < (int)TASK_BATCH && now >= next_task)
+        {
+            batch[batched] = (task_data){.id = produced++,
+                                         .v1 = (rand() % (100 * 100)) / 100.0,
+                                         .v2 = (rand() % (100 * 100)) / 100.0};
+            printf("New task queued: %u [%.2f, %.2f]\n", batch[batched].id, batch[batched].v1, batch[batched].v2);
+            if (batched++ == 0)
+                flush_at = now + FLUSH_MS;
+            next_task = now + task_delay(t1, t2);
+        }
+        if (batched > 0 && !waiting && (batched == (int)TASK_BATCH || now >= flush_at || produced == tasks))
         {
-            int res = mq_receive(*server_mq, (char *)&data, MAX_MSG_SIZE, NULL);
-            if (res == -1)
+            if (tr_send(server_mq, batch, batched * sizeof(task_data), 0, 0) == 0)
+                batched = 0;
+            else
             {
-                if (errno == EAGAIN)
-                    continue;
-                else
-                    ERR("mq_receive");
+                if (errno != EAGAIN)
+                    ERR("tr_send");
+                printf("Queue is full!\n");
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, room_fd, &room))
+                    ERR("epoll_ctl");
+                waiting = 1;
             }
+        }
+
+        int64_t deadline = INT64_MAX;
+        if (produced < tasks && batched < (int)TASK_BATCH)
+            deadline = next_task;
+        if (batched > 0 && !waiting && flush_at < deadline)
+            deadline = flush_at;
+        int timeout = -1;
+        if (deadline != INT64_MAX)
+            timeout = deadline > now_ms() ? deadline - now_ms() : 0;
+        struct epoll_event events[MAXN];
+        int ready = epoll_wait(epfd, events, MAXN, timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.u32 < (uint32_t)n)
+                results_received += drain_results(&queues[events[i].data.u32], events[i].data.u32, NULL, NULL);
             else
-                break;
+            {
+                if (epoll_ctl(epfd, EPOLL_CTL_DEL, room_fd, NULL))
+                    ERR("epoll_ctl");
+                waiting = 0;
+            }
         }
-        printf("[%d] Received task [%.2f, %.2f]\n", pid, data.v1, data.v2);
-        msleep(rand() % 1500 + 500);
-        double v = data.v1 + data.v2;
-        if (mq_send(*res_mq, (char *)&v, sizeof(double), (unsigned)pid) == -1)
-            ERR("mq_send");
-        tasks_done++;
-        if (tasks_done == N_TASKS)
-            break;
     }
-    printf("[%d] Worker done!\n", pid);
+    if (close(epfd))
+        ERR("close");
+
+    // the stop messages may have to wait for room, n can be larger than the queue
+    for (int i = 0; i < n; i++)
+        if (TEMP_FAILURE_RETRY(tr_send(server_mq, batch, 0, 0, -1)) == -1)
+            ERR("tr_send");
+}
+
+/**
+ * Picks the worker expected to get to a new task first: the fewest outstanding tasks weighted by how long its tasks
+ * take. Workers which have never reported a result are assumed to be as fast as the average.
+ * @return The worker, -1 if the task queues of all the workers are full.
+ */
+int pick_worker(int *outstanding, double *avg_ms, int n)
+{
+    double known = 0, sum = 0;
+    for (int i = 0; i < n; i++)
+        if (avg_ms[i] > 0)
+        {
+            sum += avg_ms[i];
+            known++;
+        }
+    double unknown_ms = known > 0 ? sum / known : 1;
+    int best = -1;
+    double best_cost = 0;
+    for (int i = 0; i < n; i++)
+    {
+        // a worker can't have more tasks waiting than its queue holds
+        if (outstanding[i] >= MAX_MSG_COUNT)
+            continue;
+        double cost = (outstanding[i] + 1) * (avg_ms[i] > 0 ? avg_ms[i] : unknown_ms);
+        if (best < 0 || cost < best_cost)
+        {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+/**
+ * Dispatcher mode of the server: every task goes straight to the queue of the worker expected to finish its backlog
+ * first. A task which fits nowhere waits for the next result.
+ */
+void dispatch_work(transport_t *task_queues, transport_t *queues, int n, int tasks, int t1, int t2)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        ERR("epoll_create1");
+    struct epoll_event ev = {.events = EPOLLIN};
+    for (int i = 0; i < n; i++)
+    {
+        ev.data.u32 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, tr_fd(&queues[i], TR_READABLE), &ev))
+            ERR("epoll_ctl");
+    }
+
+    int outstanding[n];
+    double avg_ms[n];
+    memset(outstanding, 0, sizeof(outstanding));
+    memset(avg_ms, 0, sizeof(avg_ms));
+    task_data task;
+    int produced = 0, results_received = 0, have_task = 0;
+    int64_t next_task = now_ms() + task_delay(t1, t2);
+    while (results_received < tasks)
+    {
+        if (!have_task && produced < tasks && now_ms() >= next_task)
+        {
+            task = (task_data){
+                .id = produced++, .v1 = (rand() % (100 * 100)) / 100.0, .v2 = (rand() % (100 * 100)) / 100.0};
+            have_task = 1;
+            next_task = now_ms() + task_delay(t1, t2);
+        }
+        int worker;
+        if (have_task && (worker = pick_worker(outstanding, avg_ms, n)) >= 0)
+        {
+            if (tr_send(&task_queues[worker], &task, sizeof(task_data), 0, 0) == -1)
+                ERR("tr_send");
+            printf("New task queued: %u [%.2f, %.2f] for worker %d (%d outstanding)\n", task.id, task.v1, task.v2,
+                   worker, outstanding[worker]);
+            outstanding[worker]++;
+            have_task = 0;
+        }
+
+        int timeout = -1;
+        if (!have_task && produced < tasks)
+            timeout = next_task > now_ms() ? next_task - now_ms() : 0;
+        struct epoll_event events[MAXN];
+        int ready = epoll_wait(epfd, events, MAXN, timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        for (int i = 0; i < ready; i++)
+            results_received +=
+                drain_results(&queues[events[i].data.u32], events[i].data.u32, outstanding, avg_ms);
+    }
+    if (close(epfd))
+        ERR("close");
+
+    // all the task queues are empty by now
+    for (int i = 0; i < n; i++)
+        if (tr_send(&task_queues[i], &task, 0, 0, 0) == -1)
+            ERR("tr_send");
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-d] [-t mq|ring] t1 t2 n [tasks [task_ms]]\n", name);
+    fprintf(stderr, "-d - dispatch tasks to per-worker queues, idle workers steal from the others\n");
+    fprintf(stderr, "-t - transport of the tasks and results, default mq\n");
+    fprintf(stderr, "t1, t2 - a new task is created every t1..t2 ms\n");
+    fprintf(stderr, "n - number of workers\n");
+    fprintf(stderr, "tasks - number of tasks (default: %d per worker)\n", N_TASKS);
+    fprintf(stderr, "task_ms - tasks take 0..task_ms ms (default: 500..2000 ms)\n");
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
 {
-    if (argc < 4)
-        ERR("usage");
-    int t1 = atoi(argv[1]), t2 = atoi(argv[2]);
-    int n = atoi(argv[3]);
+    int dispatch = 0, c;
+    tr_kind_t kind = TR_MQ;
+    while ((c = getopt(argc, argv, "dt:")) != -1)
+    {
+        switch (c)
+        {
+            case 'd':
+                dispatch = 1;
+                break;
+            case 't':
+                if (tr_parse_kind(optarg, &kind))
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    int args = argc - optind;
+    char **arg = argv + optind;
+    if (args < 3)
+        usage(argv[0]);
+    int t1 = atoi(arg[0]), t2 = atoi(arg[1]);
+    int n = atoi(arg[2]);
+    int tasks = args > 3 ? atoi(arg[3]) : n * N_TASKS;
+    int task_ms = args > 4 ? atoi(arg[4]) : -1;
+    if (t1 < 0 || t2 < t1 || n <= 0 || n > MAXN || tasks <= 0 || (args > 4 && task_ms < 0))
+        usage(argv[0]);
     printf("Server is starting...\n");
 
     int server_pid = getpid();
     char mq_name[MAXN];
     sprintf(mq_name, "/mq_%d", server_pid);
-    if (mq_unlink(mq_name) != 0)
+    if (tr_unlink(kind, mq_name) != 0)
     {
         if (errno != ENOENT)
-            ERR("mq_unlink");
+            ERR("tr_unlink");
     }
-    mqd_t server_mq = open_mq(mq_name, O_RDWR | O_CREAT | O_NONBLOCK);
-    mqd_t *queues = malloc(n * sizeof(mqd_t));
+    transport_t server_mq;
+    open_queue(&server_mq, kind, mq_name);
+    transport_t *queues = malloc(n * sizeof(transport_t));
     if (queues == NULL)
         ERR("malloc");
+    transport_t *task_queues = malloc(n * sizeof(transport_t));
+    if (task_queues == NULL)
+        ERR("malloc");
     int *worker_pids = malloc(n * sizeof(int));
     if (worker_pids == NULL)
         ERR("malloc");
+    // all the queues are opened before the first fork: the workers inherit them (a ring can't be found by name) and
+    // no worker can get to a queue which doesn't exist yet
+    for (int i = 0; i < n; i++)
+    {
+        result_queue_name(mq_name, server_pid, i);
+        open_queue(&queues[i], kind, mq_name);
+        if (dispatch)
+        {
+            task_queue_name(mq_name, server_pid, i);
+            open_queue(&task_queues[i], kind, mq_name);
+        }
+    }
+    fflush(stdout);
     for (int i = 0; i < n; i++)
     {
         int pid;
         if ((pid = fork()) == -1)
             ERR("fork");
-        sprintf(mq_name, "/mq_res_%d", (pid != 0) ? pid : getpid());
-        mqd_t res_mq = open_mq(mq_name, O_RDWR | O_CREAT | O_NONBLOCK);
         if (pid == 0)
         {
-            child_work(&server_mq, &res_mq);
-            if (mq_close(server_mq) != 0)
-                ERR("mq_close");
-            if (mq_close(res_mq) != 0)
-                ERR("mq_close");
+            if (dispatch)
+                child_dispatch_work(i, n, task_queues, &queues[i], task_ms);
+            else
+                child_work(i, &server_mq, &queues[i], task_ms);
+            close_queue(&server_mq);
+            for (int j = 0; j < n; j++)
+            {
+                close_queue(&queues[j]);
+                if (dispatch)
+                    close_queue(&task_queues[j]);
+            }
             free(queues);
+            free(task_queues);
             free(worker_pids);
             exit(EXIT_SUCCESS);
         }
         worker_pids[i] = pid;
-        queues[i] = res_mq;
-        setup_notif(&queues[i]);
     }
 
-    for (;;)
-    {
-        msleep(t1 + rand() % (t2 - t1));
-        task_data data = {.v1 = (rand() % (100 * 100)) / 100.0, .v2 = (rand() % (100 * 100)) / 100.0};
-        for (;;)
-        {
-            if (results_received == n * N_TASKS)
-                break;
-            int res = mq_send(server_mq, (char *)&data, sizeof(task_data), 0);
-            if (res != -1)
-            {
-                printf("New task queued: [%.2f, %.2f]\n", data.v1, data.v2);
-                break;
-            }
-            else
-            {
-                if (errno != EAGAIN)
-                    ERR("mq_send");
-                printf("Queue is full!\n");
-            }
-        }
-        if (results_received == n * N_TASKS)
-            break;
-    }
+    int64_t start = now_ms();
+    if (dispatch)
+        dispatch_work(task_queues, queues, n, tasks, t1, t2);
+    else
+        server_work(&server_mq, queues, n, tasks, t1, t2);
+    printf("All %d results received after %ld ms.\n", tasks, now_ms() - start);
     while (wait(NULL) > 0)
         ;
 
     printf("All child processes have finished.\n");
-    if (mq_close(server_mq) != 0)
-        ERR("mq_close");
+    close_queue(&server_mq);
     sprintf(mq_name, "/mq_%d", server_pid);
-    if (mq_unlink(mq_name) != 0)
-        ERR("mq_unlink");
+    if (tr_unlink(kind, mq_name) != 0)
+        ERR("tr_unlink");
     for (int i = 0; i < n; i++)
     {
-        sprintf(mq_name, "/mq_res_%d", worker_pids[i]);
-        if (mq_unlink(mq_name) != 0)
+        close_queue(&queues[i]);
+        result_queue_name(mq_name, server_pid, i);
+        if (tr_unlink(kind, mq_name) != 0)
         {
             printf("%d\n", worker_pids[i]);
-            ERR("mq_unlink");
+            ERR("tr_unlink");
         }
+        if (!dispatch)
+            continue;
+        close_queue(&task_queues[i]);
+        task_queue_name(mq_name, server_pid, i);
+        if (tr_unlink(kind, mq_name) != 0)
+            ERR("tr_unlink");
     }
     free(queues);
+    free(task_queues);
     free(worker_pids);
 
     return EXIT_SUCCESS;
@@ -1,7 +1,6 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
-#include <mqueue.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,12 +10,15 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "../sop_transport.h"
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 #define MAXN 256
 #define MQ_MSG_COUNT 2
 #define MQ_MSG_SIZE 256
 #define MAX_CLIENTS 8
+#define BENCH_MESSAGES 10000
 
 typedef struct
 {
@@ -24,6 +26,30 @@ typedef struct
     char name[256];
 } child_data;
 
+// Message of the benchmark mode, the word follows the header and the message is exactly as long as both.
+typedef struct bench_msg
+{
+    uint64_t sent_ns;
+    uint32_t seq;
+} bench_msg;
+
+/**
+ * Players form a ring of queues: queue 0 leads from the parent to the first player, queue i from the i-th player to
+ * the next one, the last one back to the parent. The parent keeps only the queues it still needs open, so rings of
+ * hundreds of players don't run out of descriptors.
+ */
+typedef struct game
+{
+    tr_kind_t kind;
+    uint32_t depth;
+    int p, t1, t2;
+    int bench;  // pass the messages on as fast as possible, no delays, changes or printing
+    int players;
+    transport_t first;
+    transport_t links[2];
+    transport_t* last;
+} game_t;
+
 void msleep(int msec)
 {
     time_t sec = (int)(msec / 1000);
@@ -35,79 +61,134 @@ void msleep(int msec)
         ERR("nanosleep");
 }
 
-void open_mq(mqd_t* mq, char* name)
+uint64_t now_ns(void)
 {
-    struct mq_attr mq_attr = {};
-    mq_attr.mq_maxmsg = MQ_MSG_COUNT;
-    mq_attr.mq_msgsize = MQ_MSG_SIZE;
-    *mq = mq_open(name, O_RDWR | O_CREAT, 0600, &mq_attr);
-    if (*mq == -1)
-        ERR("mq_open");
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime");
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void child_work(char* name, int prev_pid, int p, int t1, int t2)
+void queue_name(char* name, int server_pid, int i) { snprintf(name, MAXN, "/sop_mq_%d_%d", server_pid, i); }
+
+// Queue i leads from the player who joined i-th (the parent for i == 0) to the next one.
+void open_queue(transport_t* queue, game_t* game, int i)
 {
-    int pid = getpid();
-    srand(getpid());
-    printf("[%d] %s joined\n", pid, name);
-    char mq_name[MAXN];
+    char name[MAXN];
+    queue_name(name, getpid(), i);
+    if (tr_open(queue, game->kind, name, TR_CREAT, game->depth, MQ_MSG_SIZE))
+        ERR("tr_open");
+}
 
-    snprintf(mq_name, MAXN, "/sop_mq_%d", prev_pid);
-    mqd_t recv_mq;
-    open_mq(&recv_mq, mq_name);
+void close_queue(transport_t* queue)
+{
+    if (tr_close(queue) == -1)
+        ERR("tr_close");
+}
 
-    snprintf(mq_name, MAXN, "/sop_mq_%d", pid);
-    mqd_t send_mq;
-    open_mq(&send_mq, mq_name);
+// An empty message ends the game, every player passes it on before leaving.
+void child_work(char* name, transport_t* recv_mq, transport_t* send_mq, game_t* game)
+{
+    int pid = getpid();
+    srand(getpid());
+    if (!game->bench)
+        printf("[%d] %s joined\n", pid, name);
 
-    char msg[MAXN];
+    char msg[MQ_MSG_SIZE + 1];
 
     for (;;)
     {
-        memset(msg, 0, MAXN);
-        if (mq_receive(recv_mq, msg, MAXN, NULL) == -1)
-            ERR("mq_receive");
-        if (msg[0] == '!')
+        ssize_t len = TEMP_FAILURE_RETRY(tr_receive(recv_mq, msg, MQ_MSG_SIZE, NULL, -1));
+        if (len == -1)
+            ERR("tr_receive");
+        if (len == 0)
         {
-            if (mq_send(send_mq, &msg[0], 1, 0) == -1)
-                ERR("mq_send");
+            if (TEMP_FAILURE_RETRY(tr_send(send_mq, msg, 0, 0, -1)) == -1)
+                ERR("tr_send");
             break;
         }
-        printf("[%d] %s got the message: %s\n", pid, name, msg);
-        for (int i = 0; i < MAXN; i++)
+        if (!game->bench)
         {
-            if (msg[i] == '\0')
-                break;
-            if (rand() % 100 < p)
-                msg[i] = 'a' + rand() % 26;
+            msg[len] = '\0';
+            printf("[%d] %s got the message: %s\n", pid, name, msg);
+            for (int i = 0; i < len; i++)
+            {
+                if (rand() % 100 < game->p)
+                    msg[i] = 'a' + rand() % 26;
+            }
+            msleep(game->t2 > game->t1 ? game->t1 + rand() % (game->t2 - game->t1) : game->t1);
         }
-        msleep(t1 + rand() % (t2 - t1));
-        if (mq_send(send_mq, msg, MAXN, 0) == -1)
-            ERR("mq_send");
+        if (TEMP_FAILURE_RETRY(tr_send(send_mq, msg, len, 0, -1)) == -1)
+            ERR("tr_send");
     }
 
-    if (mq_close(recv_mq) == -1)
-        ERR("mq_close");
-    if (mq_close(send_mq) == -1)
-        ERR("mq_close");
-    if (mq_unlink(mq_name) == -1)
-        ERR("mq_unlink");
+    close_queue(recv_mq);
+    close_queue(send_mq);
 
-    printf("[%d] %s left\n", pid, name);
-    exit(EXIT_SUCCESS);
+    if (!game->bench)
+        printf("[%d] %s left\n", pid, name);
 }
 
-int main(int argc, char** argv)
+void add_player(game_t* game, char* name)
+{
+    transport_t* prev = game->last;
+    transport_t* next = &game->links[game->players % 2];
+    game->players++;
+    open_queue(next, game, game->players);
+    fflush(stdout);
+    int pid;
+    if ((pid = fork()) == -1)
+        ERR("fork");
+    if (pid == 0)
+    {
+        if (prev != &game->first)
+            close_queue(&game->first);
+        child_work(name, prev, next, game);
+        exit(EXIT_SUCCESS);
+    }
+    // the new player is the only one who receives from the previous queue
+    if (prev != &game->first)
+        close_queue(prev);
+    game->last = next;
+}
+
+// Waits for the empty message to come back around the ring and for all the players to leave.
+void end_game(game_t* game)
+{
+    char msg[MQ_MSG_SIZE];
+    if (TEMP_FAILURE_RETRY(tr_send(&game->first, msg, 0, 0, -1)) == -1)
+        ERR("tr_send");
+    ssize_t len;
+    while ((len = TEMP_FAILURE_RETRY(tr_receive(game->last, msg, MQ_MSG_SIZE, NULL, -1))) > 0)
+        ;
+    if (len == -1)
+        ERR("tr_receive");
+    while (wait(NULL) > 0)
+        ;
+    if (game->last != &game->first)
+        close_queue(game->last);
+    close_queue(&game->first);
+    char mq_name[MAXN];
+    for (int i = 0; i <= game->players; i++)
+    {
+        queue_name(mq_name, getpid(), i);
+        if (tr_unlink(game->kind, mq_name) == -1)
+            ERR("tr_unlink");
+    }
+}
+
+void play(game_t* game)
 {
-    if (argc < 4)
-        ERR("usage");
-    int p = atoi(argv[1]), t1 = atoi(argv[2]), t2 = atoi(argv[3]);
     char line[MAXN];
     char* ptr;
-    int prev_pid = getpid();
     for (;;)
     {
-        fgets(line, MAXN, stdin);
+        if (fgets(line, MAXN, stdin) == NULL)
+        {
+            // no sentence to pass around, let the players go
+            end_game(game);
+            return;
+        }
         line[strlen(line) - 1] = '\0';
         if (strstr(line, "start"))
         {
@@ -116,57 +197,171 @@ int main(int argc, char** argv)
             ptr[strlen(ptr) - 1] = '\0';
             break;
         }
-        int pid;
-        if ((pid = fork()) == -1)
-            ERR("fork");
-        if (pid == 0)
-            child_work(line, prev_pid, p, t1, t2);
-        prev_pid = pid;
+        add_player(game, line);
     }
     char sentence[MAXN];
     strcpy(sentence, ptr);
     printf("starting the game with sentence \"%s\"\n", sentence);
 
-    char mq_name[MAXN];
-    snprintf(mq_name, MAXN, "/sop_mq_%d", prev_pid);
-    mqd_t recv_mq;
-    open_mq(&recv_mq, mq_name);
-
-    snprintf(mq_name, MAXN, "/sop_mq_%d", getpid());
-    mqd_t send_mq;
-    open_mq(&send_mq, mq_name);
-
     int words = 0;
     char* word = strtok(sentence, " ");
     while (word != NULL)
     {
         words++;
-        if (mq_send(send_mq, word, MQ_MSG_SIZE, 0) == -1)
-            ERR("mq_send");
+        if (TEMP_FAILURE_RETRY(tr_send(&game->first, word, strlen(word), 0, -1)) == -1)
+            ERR("tr_send");
         word = strtok(NULL, " ");
     }
-    char c = '!';
-    if (mq_send(send_mq, &c, 1, 0) == -1)
-        ERR("mq_send");
 
-    char final_msg[MAXN], temp[MAXN];
-    memset(final_msg, 0, MAXN);
+    // the words come back in order and are no longer than they were, so they fit into MAXN again
+    char final_msg[MAXN];
+    char* end = final_msg;
     for (int i = 0; i < words; i++)
     {
-        if (mq_receive(recv_mq, temp, MAXN, NULL) == -1)
-            ERR("mq_receive");
         if (i != 0)
-            final_msg[strlen(final_msg)] = ' ';
-        strcat(final_msg, temp);
+            *end++ = ' ';
+        char temp[MQ_MSG_SIZE];
+        ssize_t len = TEMP_FAILURE_RETRY(tr_receive(game->last, temp, MQ_MSG_SIZE, NULL, -1));
+        if (len == -1)
+            ERR("tr_receive");
+        memcpy(end, temp, len);
+        end += len;
     }
+    *end = '\0';
     printf("final: %s\n", final_msg);
-    while (wait(NULL) > 0)
-        ;
-    if (mq_close(recv_mq) == -1)
-        ERR("mq_close");
-    if (mq_close(send_mq) == -1)
-        ERR("mq_close");
-    if (mq_unlink(mq_name) == -1)
-        ERR("mq_unlink");
+    end_game(game);
+}
+
+int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void send_bench_msg(game_t* game, char* msg, size_t len, uint32_t seq)
+{
+    bench_msg header = {.sent_ns = now_ns(), .seq = seq};
+    memcpy(msg, &header, sizeof(bench_msg));
+    if (TEMP_FAILURE_RETRY(tr_send(&game->first, msg, len, 0, -1)) == -1)
+        ERR("tr_send");
+}
+
+/**
+ * Sends `messages` copies of a word around a ring of `players` players, keeping `in_flight` of them on the way.
+ * Reports the time of a full circle and of a single hop, and how many hops per second the whole ring makes.
+ */
+void bench(game_t* game, int players, int in_flight, int messages, char* word)
+{
+    for (int i = 0; i < players; i++)
+    {
+        char name[MAXN];
+        snprintf(name, MAXN, "Player %d", i + 1);
+        add_player(game, name);
+    }
+    char msg[MQ_MSG_SIZE];
+    size_t len = sizeof(bench_msg) + strlen(word);
+    memcpy(msg + sizeof(bench_msg), word, strlen(word));
+    uint64_t* circle_ns = malloc(messages * sizeof(uint64_t));
+    if (circle_ns == NULL)
+        ERR("malloc");
+
+    uint64_t start = now_ns();
+    int sent = 0;
+    for (; sent < in_flight && sent < messages; sent++)
+        send_bench_msg(game, msg, len, sent);
+    for (int received = 0; received < messages; received++)
+    {
+        char back[MQ_MSG_SIZE];
+        if (TEMP_FAILURE_RETRY(tr_receive(game->last, back, MQ_MSG_SIZE, NULL, -1)) == -1)
+            ERR("tr_receive");
+        bench_msg header;
+        memcpy(&header, back, sizeof(bench_msg));
+        circle_ns[received] = now_ns() - header.sent_ns;
+        if (sent < messages)
+            send_bench_msg(game, msg, len, sent++);
+    }
+    uint64_t elapsed = now_ns() - start;
+    end_game(game);
+
+    int hops = players + 1;
+    qsort(circle_ns, messages, sizeof(uint64_t), compare_u64);
+    uint64_t sum = 0;
+    for (int i = 0; i < messages; i++)
+        sum += circle_ns[i];
+    double avg_us = sum / 1e3 / messages;
+    printf("%s, %d players, %d in flight, depth %u, %zu B messages\n", tr_kind_name(game->kind), players, in_flight,
+           game->depth, len);
+    printf("circle: avg %.1f us, p50 %.1f us, p99 %.1f us; hop: avg %.2f us\n", avg_us,
+           circle_ns[messages / 2] / 1e3, circle_ns[messages * 99 / 100] / 1e3, avg_us / hops);
+    printf("ring throughput: %.0f messages/s, %.0f hops/s\n", messages * 1e9 / elapsed,
+           (double)messages * hops * 1e9 / elapsed);
+    free(circle_ns);
+}
+
+void usage(char* name)
+{
+    fprintf(stderr, "USAGE: %s [-t mq|ring] [-q depth] p t1 t2\n", name);
+    fprintf(stderr, "       %s -b [-t mq|ring] [-q depth] [-w in_flight] [-m messages] players [word]\n", name);
+    fprintf(stderr, "-t - transport between the players, default mq\n");
+    fprintf(stderr, "-q - capacity of every queue, default %d\n", MQ_MSG_COUNT);
+    fprintf(stderr, "-b - benchmark: messages go around without delays, in_flight of them at once (default 1)\n");
+    fprintf(stderr, "-m - messages sent in the benchmark, default %d\n", BENCH_MESSAGES);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    game_t game = {.kind = TR_MQ, .depth = MQ_MSG_COUNT};
+    int in_flight = 1, messages = BENCH_MESSAGES, c;
+    while ((c = getopt(argc, argv, "t:q:bw:m:")) != -1)
+    {
+        switch (c)
+        {
+            case 't':
+                if (tr_parse_kind(optarg, &game.kind))
+                    usage(argv[0]);
+                break;
+            case 'q':
+                game.depth = atoi(optarg);
+                break;
+            case 'b':
+                game.bench = 1;
+                break;
+            case 'w':
+                in_flight = atoi(optarg);
+                break;
+            case 'm':
+                messages = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (game.depth == 0 || game.depth > 1 << 20)
+        usage(argv[0]);
+    // the queues are opened before the children are forked, so that a ring is shared with them
+    open_queue(&game.first, &game, 0);
+    game.last = &game.first;
+
+    if (!game.bench)
+    {
+        if (argc - optind != 3)
+            usage(argv[0]);
+        game.p = atoi(argv[optind]);
+        game.t1 = atoi(argv[optind + 1]);
+        game.t2 = atoi(argv[optind + 2]);
+        play(&game);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc - optind != 1 && argc - optind != 2)
+        usage(argv[0]);
+    int players = atoi(argv[optind]);
+    char* word = argc - optind == 2 ? argv[optind + 1] : "telephone";
+    // more messages than all the queues hold would block the parent in tr_send with the last queue full
+    if (players <= 0 || in_flight <= 0 || (uint64_t)in_flight > (uint64_t)(players + 1) * game.depth ||
+        messages <= 0 || strlen(word) > MQ_MSG_SIZE - sizeof(bench_msg))
+        usage(argv[0]);
+    bench(&game, players, in_flight, messages, word);
     return EXIT_SUCCESS;
 }
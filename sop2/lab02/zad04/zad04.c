@@ -1,13 +1,17 @@
-#include <fcntl.h>
-#include <signal.h>
 #define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <mqueue.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #define ERR(source) \
@@ -15,123 +19,622 @@
 #define MAXN 256
 #define MQ_MSG_COUNT 10
 #define MQ_MSG_SIZE 4096
-#define MAX_CLIENTS 8
+#define MAX_NAME 32
+#define MAX_EVENTS 64
+#define MAX_BACKLOG 64
+#define SEND_TIMEOUT_S 1
+
+// Priorities of the messages, a client's queue hands out the server's notices before urgent ("!...") lines before
+// the rest. Joining and leaving are ordinary lines, so that they stay in order with what the client said.
+#define PRIO_TEXT 0
+#define PRIO_URGENT 1
+#define PRIO_NOTICE 2
 
+enum chat_type
+{
+    CHAT_JOIN,
+    CHAT_TEXT,
+    CHAT_LEAVE,
+    CHAT_NOTICE,
+    CHAT_QUIT
+};
+
+// Every message in both directions. Only the header and the used part of the text are sent.
 typedef struct
 {
-    char* name;
+    int type;
+    pid_t pid;
+    char name[MAX_NAME];
+    char text[MQ_MSG_SIZE - MAX_NAME - 2 * sizeof(int)];
+} chat_msg;
+
+#define CHAT_HEADER offsetof(chat_msg, text)
+
+// A message waiting for slow clients, shared by the backlogs of all of them.
+typedef struct
+{
+    int refs;
+    unsigned int prio;
+    size_t len;
+    char data[];
+} chat_buf;
+
+typedef struct
+{
+    pid_t pid;
+    char name[MAX_NAME];
     mqd_t mq;
+    int index;
+    // messages that didn't fit into the client's queue, in order, and how many were thrown away after that
+    chat_buf* backlog[MAX_BACKLOG];
+    int head;
+    int count;
+    long missed;
 } client_data;
 
-volatile sig_atomic_t server_quit = 0;
+typedef struct
+{
+    char* name;
+    mqd_t mq;
+    int epoll_fd;
+    client_data** clients;
+    int n_clients;
+    int capacity;
+} server_data;
 
-int set_handler(void (*f)(int), int signo)
+void usage(char* name)
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof(struct sigaction));
-    act.sa_handler = f;
-    if (sigaction(signo, &act, NULL) == -1)
+    fprintf(stderr, "USAGE: %s server server_name\n", name);
+    fprintf(stderr, "       %s client server_name client_name\n", name);
+    fprintf(stderr, "A client sends lines of stdin to the chat, lines starting with '!' are urgent.\n");
+    fprintf(stderr, "Every client needs a queue, so the chat is limited by /proc/sys/fs/mqueue/queues_max and by\n");
+    fprintf(stderr, "the bytes of queues a user may have (ulimit -q), about %d kB per client.\n",
+            MQ_MSG_COUNT * MQ_MSG_SIZE / 1000);
+    exit(EXIT_FAILURE);
+}
+
+void client_queue_name(char* name, char* server_name, pid_t pid)
+{
+    snprintf(name, MAXN, "/chat_%s_%d", server_name, pid);
+}
+
+/**
+ * Blocks SIGINT and returns a descriptor which becomes readable when it arrives, so that it can wait in epoll
+ * together with the queues.
+ */
+int open_signalfd(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL))
+        ERR("sigprocmask");
+    int fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (fd < 0)
+        ERR("signalfd");
+    return fd;
+}
+
+void epoll_set(int epoll_fd, int op, int fd, uint32_t events, void* ptr)
+{
+    struct epoll_event event = {.events = events, .data.ptr = ptr};
+    if (epoll_ctl(epoll_fd, op, fd, &event) < 0)
+        ERR("epoll_ctl");
+}
+
+size_t fill_msg(chat_msg* msg, int type, pid_t pid, const char* name, const char* text)
+{
+    msg->type = type;
+    msg->pid = pid;
+    snprintf(msg->name, MAX_NAME, "%s", name);
+    snprintf(msg->text, sizeof(msg->text), "%s", text);
+    return CHAT_HEADER + strlen(msg->text) + 1;
+}
+
+// Makes the strings of a received message safe to print, whatever the sender put into it.
+int check_msg(chat_msg* msg, ssize_t len)
+{
+    if (len < (ssize_t)CHAT_HEADER)
         return -1;
+    msg->name[MAX_NAME - 1] = '\0';
+    if (len == (ssize_t)CHAT_HEADER)
+        msg->text[0] = '\0';
+    else
+        msg->text[len - CHAT_HEADER - 1] = '\0';
+    return 0;
+}
+
+chat_buf* make_buf(unsigned int prio, int type, pid_t pid, const char* name, const char* text)
+{
+    chat_msg msg;
+    size_t len = fill_msg(&msg, type, pid, name, text);
+    chat_buf* buf = malloc(sizeof(chat_buf) + len);
+    if (buf == NULL)
+        ERR("malloc");
+    buf->refs = 1;
+    buf->prio = prio;
+    buf->len = len;
+    memcpy(buf->data, &msg, len);
+    return buf;
+}
+
+void release_buf(chat_buf* buf)
+{
+    if (--buf->refs == 0)
+        free(buf);
+}
+
+// The client's queue is nonblocking, the server never waits for a single client.
+int deliver(client_data* client, chat_buf* buf)
+{
+    if (mq_send(client->mq, buf->data, buf->len, buf->prio) == 0)
+        return 0;
+    if (errno != EAGAIN)
+        ERR("mq_send");
+    return -1;
+}
+
+int client_idle(client_data* client) { return client->count == 0 && client->missed == 0; }
+
+void remove_client(server_data* server, client_data* client)
+{
+    if (!client_idle(client))
+        epoll_set(server->epoll_fd, EPOLL_CTL_DEL, client->mq, 0, NULL);
+    for (int i = 0; i < client->count; i++)
+        release_buf(client->backlog[(client->head + i) % MAX_BACKLOG]);
+    if (mq_close(client->mq))
+        ERR("mq_close");
+    client_data* last = server->clients[--server->n_clients];
+    last->index = client->index;
+    server->clients[client->index] = last;
+    free(client);
+}
+
+// A client killed before it could leave. Its queue would stay charged against the limits of its owner.
+void drop_client(server_data* server, client_data* client)
+{
+    char name[MAXN];
+    client_queue_name(name, server->name, client->pid);
+    printf("%s is gone, %d clients\n", client->name, server->n_clients - 1);
+    remove_client(server, client);
+    if (mq_unlink(name) && errno != ENOENT)
+        ERR("mq_unlink");
+}
+
+/**
+ * Sends the message to the client or, if its queue is full, keeps it in the backlog and asks epoll to report when
+ * there is room again. Once the backlog is full too, the client only counts what it has missed, so one stalled
+ * reader costs the server a bounded amount of memory and the others don't wait for it. A client that stalled because
+ * it died is removed then.
+ * @return 0, or -1 if the client was removed.
+ */
+int enqueue(server_data* server, client_data* client, chat_buf* buf)
+{
+    if (client_idle(client))
+    {
+        if (deliver(client, buf) == 0)
+            return 0;
+        epoll_set(server->epoll_fd, EPOLL_CTL_ADD, client->mq, EPOLLOUT, client);
+    }
+    else if (client->count == MAX_BACKLOG)
+    {
+        if (kill(client->pid, 0) && errno == ESRCH)
+        {
+            drop_client(server, client);
+            return -1;
+        }
+        client->missed++;
+        return 0;
+    }
+    client->backlog[(client->head + client->count++) % MAX_BACKLOG] = buf;
+    buf->refs++;
     return 0;
 }
 
-void sigint_handler(int signo) { server_quit = 1; }
+// Called when the client's queue has room again.
+void flush_client(server_data* server, client_data* client)
+{
+    while (client->count > 0)
+    {
+        if (deliver(client, client->backlog[client->head]))
+            return;
+        release_buf(client->backlog[client->head]);
+        client->head = (client->head + 1) % MAX_BACKLOG;
+        client->count--;
+    }
+    if (client->missed > 0)
+    {
+        char text[MAXN];
+        snprintf(text, MAXN, "your queue was full, you missed %ld messages", client->missed);
+        chat_buf* buf = make_buf(PRIO_NOTICE, CHAT_NOTICE, getpid(), "server", text);
+        client->missed = 0;
+        if (deliver(client, buf))
+        {
+            client->backlog[client->head] = buf;
+            client->count = 1;
+            return;
+        }
+        release_buf(buf);
+    }
+    epoll_set(server->epoll_fd, EPOLL_CTL_DEL, client->mq, 0, NULL);
+}
 
-void handle_msgs(union sigval data);
+void broadcast(server_data* server, chat_buf* buf)
+{
+    // a removed client is replaced by the last one, which still has to get the message
+    for (int i = 0; i < server->n_clients;)
+        if (enqueue(server, server->clients[i], buf) == 0)
+            i++;
+    release_buf(buf);
+}
 
-void register_notif(client_data* data)
+client_data* find_client(server_data* server, pid_t pid)
 {
-    struct sigevent notif = {
-        .sigev_value.sival_ptr = data, .sigev_notify = SIGEV_THREAD, .sigev_notify_function = handle_msgs};
-    if (mq_notify(data->mq, &notif) == -1)
-        ERR("mq_notify");
+    for (int i = 0; i < server->n_clients; i++)
+        if (server->clients[i]->pid == pid)
+            return server->clients[i];
+    return NULL;
 }
 
-void handle_msgs(union sigval data)
+client_data* add_client(server_data* server, char* server_name, chat_msg* msg)
 {
-    client_data* client_data = data.sival_ptr;
-    char msg[MQ_MSG_SIZE];
-    unsigned int priority;
-    register_notif(client_data);
+    char name[MAXN];
+    client_queue_name(name, server_name, msg->pid);
+    mqd_t mq = mq_open(name, O_WRONLY | O_NONBLOCK);
+    if (mq == -1)
+    {
+        // the client is gone already or it is out of descriptors, either way it can't join
+        fprintf(stderr, "can't open the queue of %s: %s\n", msg->name, strerror(errno));
+        return NULL;
+    }
+    if (server->n_clients == server->capacity)
+    {
+        server->capacity = server->capacity ? 2 * server->capacity : MAX_EVENTS;
+        server->clients = realloc(server->clients, server->capacity * sizeof(client_data*));
+        if (server->clients == NULL)
+            ERR("realloc");
+    }
+    client_data* client = calloc(1, sizeof(client_data));
+    if (client == NULL)
+        ERR("calloc");
+    client->pid = msg->pid;
+    strcpy(client->name, msg->name);
+    client->mq = mq;
+    client->index = server->n_clients;
+    server->clients[server->n_clients++] = client;
+    return client;
+}
 
-    for (;;)
+void handle_msg(server_data* server, char* server_name, chat_msg* msg, unsigned int prio)
+{
+    client_data* client = find_client(server, msg->pid);
+    switch (msg->type)
     {
-        if (mq_receive(client_data->mq, msg, MQ_MSG_SIZE, &priority) != -1)
-            printf("[%s] recieved \"%s\" with priority %d\n", client_data->name, msg, priority);
-        else
+        case CHAT_JOIN:
+            if (client != NULL || (client = add_client(server, server_name, msg)) == NULL)
+                break;
+            printf("%s joined, %d clients\n", client->name, server->n_clients);
+            broadcast(server, make_buf(PRIO_TEXT, CHAT_JOIN, client->pid, client->name, ""));
+            break;
+        case CHAT_TEXT:
+            if (client == NULL)
+                break;
+            printf("[%s] %s\n", client->name, msg->text);
+            // clients can't make their lines look like notices
+            prio = prio > PRIO_URGENT ? PRIO_URGENT : prio;
+            broadcast(server, make_buf(prio, CHAT_TEXT, client->pid, client->name, msg->text));
+            break;
+        case CHAT_LEAVE:
         {
-            if (errno == EAGAIN)
+            if (client == NULL)
                 break;
-            else
-                ERR("mq_receive");
+            printf("%s left, %d clients\n", client->name, server->n_clients - 1);
+            chat_buf* buf = make_buf(PRIO_TEXT, CHAT_LEAVE, client->pid, client->name, "");
+            remove_client(server, client);
+            broadcast(server, buf);
+            break;
         }
     }
 }
 
-void run_client(char* server_name, char* client_name)
+// Every client has its own queue descriptor, let the server have as many as the hard limit allows.
+void raise_fd_limit(void)
 {
-    char send_mq_name[MAXN];
-    sprintf(send_mq_name, "/chat_%s", server_name);
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit))
+        ERR("getrlimit");
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit))
+        ERR("setrlimit");
+}
+
+/**
+ * A single thread waits in epoll for the server queue, for SIGINT and for the queues of clients which have a
+ * backlog. Nothing runs while the chat is silent, and a message costs one mq_send per client.
+ */
+void run_server(char* server_name)
+{
+    raise_fd_limit();
+    char recv_mq_name[MAXN];
+    snprintf(recv_mq_name, MAXN, "/chat_%s", server_name);
     struct mq_attr attr = {.mq_maxmsg = MQ_MSG_COUNT, .mq_msgsize = MQ_MSG_SIZE};
-    mqd_t send_mq = mq_open(send_mq_name, O_RDWR | O_CREAT | O_NONBLOCK, 0600, &attr);
-    if (send_mq == -1)
+    server_data server = {.name = server_name};
+    server.mq = mq_open(recv_mq_name, O_RDONLY | O_CREAT | O_NONBLOCK, 0600, &attr);
+    if (server.mq == -1)
         ERR("mq_open");
+    int signal_fd = open_signalfd();
+    if ((server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        ERR("epoll_create1");
+    epoll_set(server.epoll_fd, EPOLL_CTL_ADD, server.mq, EPOLLIN, &server);
+    epoll_set(server.epoll_fd, EPOLL_CTL_ADD, signal_fd, EPOLLIN, NULL);
 
-    char msg[MQ_MSG_SIZE];
-    strcpy(msg, client_name);
-    if (mq_send(send_mq, msg, MQ_MSG_SIZE, 0) == -1)
-        ERR("mq_send");
-    printf("sent\n");
+    int quit = 0;
+    while (!quit)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int ready = epoll_wait(server.epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                quit = 1;
+            else if (events[i].data.ptr != &server)
+                flush_client(&server, events[i].data.ptr);
+        }
+        // a client which has just left may still be on the list of events, so the queue is read after them
+        chat_msg msg;
+        unsigned int prio;
+        ssize_t len;
+        while (!quit && (len = mq_receive(server.mq, (char*)&msg, sizeof(chat_msg), &prio)) >= 0)
+            if (check_msg(&msg, len) == 0)
+                handle_msg(&server, server_name, &msg, prio);
+        if (!quit && errno != EAGAIN)
+            ERR("mq_receive");
+        fflush(stdout);
+    }
 
-    if (mq_close(send_mq) != 0)
+    // clients whose queue is full don't get the notice, they stay until their stdin ends or SIGINT
+    chat_buf* buf = make_buf(PRIO_NOTICE, CHAT_QUIT, getpid(), "server", "");
+    while (server.n_clients > 0)
+    {
+        deliver(server.clients[0], buf);
+        remove_client(&server, server.clients[0]);
+    }
+    release_buf(buf);
+    free(server.clients);
+    if (close(server.epoll_fd) || close(signal_fd))
+        ERR("close");
+    if (mq_close(server.mq) != 0)
         ERR("mq_close");
+    if (mq_unlink(recv_mq_name) != 0)
+        ERR("mq_unlink");
+}
+
+typedef struct
+{
+    mqd_t server_mq;
+    int epoll_fd;
+    int stdin_pollable;
+    int stdin_eof;
+    int waiting_for_server;
+    // stdin which hasn't been sent yet, with room for a newline after a line which doesn't end with one
+    char input[sizeof(((chat_msg*)0)->text)];
+    size_t used;
+    // a line waiting for room in the server queue, stdin isn't read until it is sent
+    chat_msg pending;
+    size_t pending_len;
+    unsigned int pending_prio;
+} client_state;
 
-    // why can't this be here?
-    // if (mq_unlink(send_mq_name) != 0)
-    //     ERR("mq_unlink");
+void print_msg(chat_msg* msg, unsigned int prio)
+{
+    switch (msg->type)
+    {
+        case CHAT_JOIN:
+            printf("* %s joined\n", msg->name);
+            break;
+        case CHAT_LEAVE:
+            printf("* %s left\n", msg->name);
+            break;
+        case CHAT_NOTICE:
+            printf("* %s\n", msg->text);
+            break;
+        case CHAT_TEXT:
+            printf("[%s]%s %s\n", msg->name, prio == PRIO_URGENT ? " (urgent)" : "", msg->text);
+            break;
+    }
 }
 
-void run_server(char* server_name)
+// The client waits either for stdin or, while a line is pending, for room in the server queue.
+void update_watch(client_state* state)
 {
-    client_data clients[MAX_CLIENTS];
-    int n_clients = 0;
+    int waiting = state->pending_len > 0;
+    if (waiting == state->waiting_for_server)
+        return;
+    state->waiting_for_server = waiting;
+    if (state->stdin_pollable)
+        epoll_set(state->epoll_fd, waiting ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, STDIN_FILENO, EPOLLIN, NULL);
+    epoll_set(state->epoll_fd, waiting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, state->server_mq, EPOLLOUT, &state->pending);
+}
 
-    char recv_mq_name[MAXN];
-    sprintf(recv_mq_name, "/chat_%s", server_name);
+/**
+ * Sends the complete lines of state->input. When the server queue is full, the line is kept in state->pending and
+ * the client waits for room in the server queue instead of reading stdin, so a slow server slows its clients down
+ * rather than making them buffer.
+ */
+void send_lines(client_state* state, char* name)
+{
+    char* line = state->input;
+    char* end;
+    while (state->pending_len == 0 && (end = memchr(line, '\n', state->input + state->used - line)) != NULL)
+    {
+        *end = '\0';
+        int urgent = line[0] == '!';
+        size_t len = fill_msg(&state->pending, CHAT_TEXT, getpid(), name, line + urgent);
+        unsigned int prio = urgent ? PRIO_URGENT : PRIO_TEXT;
+        line = end + 1;
+        if (mq_send(state->server_mq, (char*)&state->pending, len, prio) == 0)
+            continue;
+        if (errno != EAGAIN)
+            ERR("mq_send");
+        state->pending_len = len;
+        state->pending_prio = prio;
+    }
+    state->used -= line - state->input;
+    memmove(state->input, line, state->used);
+    update_watch(state);
+}
+
+void read_stdin(client_state* state, char* name)
+{
+    size_t room = sizeof(state->input) - 1 - state->used;
+    ssize_t count = TEMP_FAILURE_RETRY(read(STDIN_FILENO, state->input + state->used, room));
+    if (count < 0)
+        ERR("read");
+    state->used += count;
+    state->stdin_eof = count == 0;
+    // a line longer than a message is cut into several, the last line may have no newline
+    if ((count == 0 || (size_t)count == room) && state->used > 0 && memchr(state->input, '\n', state->used) == NULL)
+        state->input[state->used++] = '\n';
+    send_lines(state, name);
+}
+
+// Used for joining and leaving, which can't be postponed like the lines.
+int timed_send(mqd_t mq, chat_msg* msg, size_t len, unsigned int prio)
+{
+    struct mq_attr blocking = {.mq_flags = 0};
+    if (mq_setattr(mq, &blocking, NULL))
+        ERR("mq_setattr");
+    struct timespec deadline;
+    if (clock_gettime(CLOCK_REALTIME, &deadline))
+        ERR("clock_gettime");
+    deadline.tv_sec += SEND_TIMEOUT_S;
+    return TEMP_FAILURE_RETRY(mq_timedsend(mq, (char*)msg, len, prio, &deadline));
+}
+
+void resend_pending(client_state* state, char* name)
+{
+    if (mq_send(state->server_mq, (char*)&state->pending, state->pending_len, state->pending_prio))
+    {
+        if (errno != EAGAIN)
+            ERR("mq_send");
+        return;
+    }
+    state->pending_len = 0;
+    send_lines(state, name);
+}
+
+/**
+ * The client waits in epoll for its own queue, stdin and SIGINT. It leaves at the end of stdin or on SIGINT, and
+ * stops when the server closes the chat.
+ */
+void run_client(char* server_name, char* client_name)
+{
+    char send_mq_name[MAXN], recv_mq_name[MAXN];
+    snprintf(send_mq_name, MAXN, "/chat_%s", server_name);
+    client_queue_name(recv_mq_name, server_name, getpid());
     struct mq_attr attr = {.mq_maxmsg = MQ_MSG_COUNT, .mq_msgsize = MQ_MSG_SIZE};
-    mqd_t recv_mq = mq_open(recv_mq_name, O_RDWR | O_CREAT | O_NONBLOCK, 0600, &attr);
+    mqd_t recv_mq = mq_open(recv_mq_name, O_RDONLY | O_CREAT | O_EXCL | O_NONBLOCK, 0600, &attr);
     if (recv_mq == -1)
         ERR("mq_open");
+    client_state state = {.stdin_pollable = 1};
+    // the server creates its queue, a client can't start a chat on its own
+    if ((state.server_mq = mq_open(send_mq_name, O_WRONLY | O_NONBLOCK)) == -1)
+        ERR("mq_open");
+    int signal_fd = open_signalfd();
+    if ((state.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        ERR("epoll_create1");
+    epoll_set(state.epoll_fd, EPOLL_CTL_ADD, recv_mq, EPOLLIN, &recv_mq);
+    epoll_set(state.epoll_fd, EPOLL_CTL_ADD, signal_fd, EPOLLIN, &signal_fd);
+    // a regular file can't be watched by epoll, but it never blocks either
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(state.epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0)
+    {
+        if (errno != EPERM)
+            ERR("epoll_ctl");
+        state.stdin_pollable = 0;
+    }
 
-    client_data server_data;
-    server_data.name = server_name;
-    server_data.mq = recv_mq;
-    union sigval data = {.sival_ptr = &server_data};
-    handle_msgs(data);
+    // the join notice has the highest priority, so it gets to the server before any of the lines
+    chat_msg msg;
+    size_t len = fill_msg(&msg, CHAT_JOIN, getpid(), client_name, "");
+    if (timed_send(state.server_mq, &msg, len, PRIO_NOTICE))
+        ERR("mq_timedsend");
+    struct mq_attr nonblocking = {.mq_flags = O_NONBLOCK};
+    if (mq_setattr(state.server_mq, &nonblocking, NULL))
+        ERR("mq_setattr");
 
-    for (;;)
-        ;
+    int quit = 0, server_gone = 0;
+    while (!quit)
+    {
+        int ready_stdin = !state.stdin_pollable && !state.stdin_eof && state.pending_len == 0;
+        struct epoll_event events[MAX_EVENTS];
+        int ready = epoll_wait(state.epoll_fd, events, MAX_EVENTS, ready_stdin ? 0 : -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        if (ready_stdin)
+            read_stdin(&state, client_name);
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                read_stdin(&state, client_name);
+            else if (events[i].data.ptr == &state.pending)
+                resend_pending(&state, client_name);
+            else if (events[i].data.ptr == &signal_fd)
+                quit = 1;
+        }
+        unsigned int prio;
+        ssize_t len;
+        while ((len = mq_receive(recv_mq, (char*)&msg, sizeof(chat_msg), &prio)) >= 0)
+        {
+            if (check_msg(&msg, len))
+                continue;
+            if (msg.type == CHAT_QUIT)
+                quit = server_gone = 1;
+            else
+                print_msg(&msg, prio);
+        }
+        if (errno != EAGAIN)
+            ERR("mq_receive");
+        fflush(stdout);
+        if (state.stdin_eof && state.pending_len == 0)
+            quit = 1;
+    }
 
-    if (mq_close(recv_mq) != 0)
+    if (server_gone)
+        printf("the server has closed the chat\n");
+    else
+    {
+        // a line still waiting for the server is lost, the leave notice follows the lines already sent
+        len = fill_msg(&msg, CHAT_LEAVE, getpid(), client_name, "");
+        if (timed_send(state.server_mq, &msg, len, PRIO_TEXT) && errno != ETIMEDOUT)
+            ERR("mq_timedsend");
+    }
+    if (close(state.epoll_fd) || close(signal_fd))
+        ERR("close");
+    if (mq_close(state.server_mq) || mq_close(recv_mq))
         ERR("mq_close");
-    if (mq_unlink(recv_mq_name) != 0)
+    // only the client uses its queue, the server keeps its descriptor open until it reads the leave notice
+    if (mq_unlink(recv_mq_name))
         ERR("mq_unlink");
 }
 
 int main(int argc, char** argv)
 {
-    char* mode = argv[1];
-    char* server_name = argv[2];
-    if (strcmp(mode, "client") == 0)
-    {
-        printf("Running as client\n");
-        char* client_name = argv[3];
-        run_client(server_name, client_name);
-    }
+    if (argc == 3 && strcmp(argv[1], "server") == 0)
+        run_server(argv[2]);
+    else if (argc == 4 && strcmp(argv[1], "client") == 0)
+        run_client(argv[2], argv[3]);
     else
-    {
-        printf("Running as server\n");
-        run_server(server_name);
-    }
+        usage(argv[0]);
     return EXIT_SUCCESS;
 }
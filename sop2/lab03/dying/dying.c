@@ -1,22 +1,35 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../sop_lease.h"
+
 #define BUFFER_SIZE 10
 #define ITERATIONS 10000000
 
+#define CACHE_LINE 64
+#define MAX_WORKERS 256
+#define BENCH_ITERATIONS 1000000
+#define LEASE_UNITS_PER_WORKER 8
+#define LEASE_MS 200
+#define LEASE_RENEW_EVERY (1 << 16)
+
 typedef struct context
 {
     pthread_mutex_t mtx;
@@ -81,10 +94,391 @@ void consumer(context_t *ctx)
     }
 }
 
-int main()
+enum strategy
 {
-    srand(getpid());
+    ROBUST_MUTEX,
+    PLAIN_MUTEX,
+    SPINLOCK,
+    FUTEX_MUTEX,
+    ATOMIC_ADD,
+    SHARDED,
+    N_STRATEGIES
+};
+
+const char *strategy_names[N_STRATEGIES] = {"robust mutex", "mutex",       "spinlock",
+                                            "futex mutex",  "atomic add", "sharded"};
+
+typedef struct shard
+{
+    _Alignas(CACHE_LINE) _Atomic uint64_t value;
+    // when the worker owning the shard started and stopped counting
+    uint64_t start_ns;
+    uint64_t end_ns;
+} shard_t;
+
+// every contended word lives on its own cache line
+typedef struct bench
+{
+    pthread_barrier_t start;
+    _Alignas(CACHE_LINE) pthread_mutex_t robust;
+    _Alignas(CACHE_LINE) pthread_mutex_t plain;
+    _Alignas(CACHE_LINE) pthread_spinlock_t spin;
+    _Alignas(CACHE_LINE) _Atomic uint32_t futex;
+    _Alignas(CACHE_LINE) uint64_t counter;
+    _Alignas(CACHE_LINE) _Atomic uint64_t atomic_counter;
+    shard_t shards[MAX_WORKERS];
+} bench_t;
+
+typedef struct worker_args
+{
+    pthread_t tid;
+    bench_t *b;
+    int id;
+    int strategy;
+    long iterations;
+} worker_args_t;
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+long futex(_Atomic uint32_t *uaddr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, (uint32_t *)uaddr, op, val, NULL, NULL, 0);
+}
+
+// 0 - unlocked, 1 - locked, 2 - locked with waiters (U. Drepper, "Futexes Are Tricky")
+void futex_lock(_Atomic uint32_t *f)
+{
+    uint32_t c = 0;
+    if (atomic_compare_exchange_strong(f, &c, 1))
+        return;
+    if (c != 2)
+        c = atomic_exchange(f, 2);
+    while (c != 0)
+    {
+        futex(f, FUTEX_WAIT, 2);
+        c = atomic_exchange(f, 2);
+    }
+}
+
+void futex_unlock(_Atomic uint32_t *f)
+{
+    if (atomic_fetch_sub(f, 1) != 1)
+    {
+        atomic_store(f, 0);
+        futex(f, FUTEX_WAKE, 1);
+    }
+}
+
+void lock_robust(pthread_mutex_t *mtx)
+{
+    int err;
+    if ((err = pthread_mutex_lock(mtx)) != 0)
+    {
+        if (err == EOWNERDEAD)
+        {
+            pthread_mutex_consistent(mtx);
+        }
+        else
+        {
+            fprintf(stderr, "pthread_mutex_lock(): %s", strerror(err));
+            exit(1);
+        }
+    }
+}
+
+void *bench_worker(void *voidPtr)
+{
+    worker_args_t *args = voidPtr;
+    bench_t *b = args->b;
+    pthread_barrier_wait(&b->start);
+    b->shards[args->id].start_ns = now_ns();
 
+    switch (args->strategy)
+    {
+        case ROBUST_MUTEX:
+            for (long i = 0; i < args->iterations; ++i)
+            {
+                lock_robust(&b->robust);
+                b->counter++;
+                pthread_mutex_unlock(&b->robust);
+            }
+            break;
+        case PLAIN_MUTEX:
+            for (long i = 0; i < args->iterations; ++i)
+            {
+                pthread_mutex_lock(&b->plain);
+                b->counter++;
+                pthread_mutex_unlock(&b->plain);
+            }
+            break;
+        case SPINLOCK:
+            for (long i = 0; i < args->iterations; ++i)
+            {
+                pthread_spin_lock(&b->spin);
+                b->counter++;
+                pthread_spin_unlock(&b->spin);
+            }
+            break;
+        case FUTEX_MUTEX:
+            for (long i = 0; i < args->iterations; ++i)
+            {
+                futex_lock(&b->futex);
+                b->counter++;
+                futex_unlock(&b->futex);
+            }
+            break;
+        case ATOMIC_ADD:
+            for (long i = 0; i < args->iterations; ++i)
+                atomic_fetch_add_explicit(&b->atomic_counter, 1, memory_order_relaxed);
+            break;
+        case SHARDED:
+        {
+            // only this worker writes its shard, so no read-modify-write is needed
+            _Atomic uint64_t *shard = &b->shards[args->id].value;
+            for (long i = 0; i < args->iterations; ++i)
+                atomic_store_explicit(shard, atomic_load_explicit(shard, memory_order_relaxed) + 1,
+                                      memory_order_relaxed);
+            break;
+        }
+    }
+    b->shards[args->id].end_ns = now_ns();
+    return NULL;
+}
+
+uint64_t bench_total(bench_t *b, int workers)
+{
+    uint64_t total = b->counter + atomic_load(&b->atomic_counter);
+    for (int i = 0; i < workers; i++)
+        total += atomic_load(&b->shards[i].value);
+    return total;
+}
+
+void bench_reset(bench_t *b, int workers)
+{
+    b->counter = 0;
+    atomic_store(&b->atomic_counter, 0);
+    for (int i = 0; i < MAX_WORKERS; i++)
+        atomic_store(&b->shards[i].value, 0);
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&b->start, &attr, workers + 1);
+    pthread_barrierattr_destroy(&attr);
+}
+
+// Returns the wall time of `workers` processes or threads doing `iterations` increments each, in seconds.
+double bench_run(bench_t *b, int strategy, int workers, int use_threads, long iterations)
+{
+    bench_reset(b, workers);
+    fflush(stdout);
+    worker_args_t args[workers];
+    for (int i = 0; i < workers; i++)
+    {
+        args[i] = (worker_args_t){.b = b, .id = i, .strategy = strategy, .iterations = iterations};
+        if (use_threads)
+        {
+            int err;
+            if ((err = pthread_create(&args[i].tid, NULL, bench_worker, &args[i])) != 0)
+            {
+                fprintf(stderr, "pthread_create(): %s", strerror(err));
+                exit(1);
+            }
+            continue;
+        }
+        switch (fork())
+        {
+            case -1:
+                perror("fork()");
+                exit(1);
+            case 0:
+                bench_worker(&args[i]);
+                exit(0);
+        }
+    }
+
+    pthread_barrier_wait(&b->start);
+    if (use_threads)
+    {
+        for (int i = 0; i < workers; i++)
+            pthread_join(args[i].tid, NULL);
+    }
+    else
+    {
+        while (wait(NULL) > 0)
+            ;
+    }
+    pthread_barrier_destroy(&b->start);
+
+    // the workers time themselves, so process creation and teardown are not measured
+    uint64_t start = UINT64_MAX, end = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        if (b->shards[i].start_ns < start)
+            start = b->shards[i].start_ns;
+        if (b->shards[i].end_ns > end)
+            end = b->shards[i].end_ns;
+    }
+
+    uint64_t total = bench_total(b, workers);
+    if (total != (uint64_t)workers * iterations)
+        fprintf(stderr, "%s: counter = %lu, expected %lu\n", strategy_names[strategy], total,
+                (uint64_t)workers * iterations);
+    return (end - start) / 1e9;
+}
+
+// 1, 2, 4, ... and finally max_workers itself
+int next_workers(int workers, int max_workers)
+{
+    if (workers < max_workers && workers * 2 > max_workers)
+        return max_workers;
+    return workers * 2;
+}
+
+int run_bench(int max_workers, long iterations)
+{
+    bench_t *b = mmap(NULL, sizeof(bench_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+    {
+        perror("mmap()");
+        return 1;
+    }
+    memset(b, 0, sizeof(bench_t));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&b->plain, &attr);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&b->robust, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_spin_init(&b->spin, PTHREAD_PROCESS_SHARED);
+
+    printf("%-14s %-9s %7s %10s %10s %8s\n", "strategy", "mode", "workers", "ns/op", "Mops/s", "scaling");
+    for (int strategy = 0; strategy < N_STRATEGIES; strategy++)
+    {
+        for (int use_threads = 0; use_threads <= 1; use_threads++)
+        {
+            double base = 0;
+            for (int workers = 1; workers <= max_workers; workers = next_workers(workers, max_workers))
+            {
+                double elapsed = bench_run(b, strategy, workers, use_threads, iterations);
+                double ops = (double)workers * iterations;
+                double mops = ops / elapsed / 1e6;
+                if (workers == 1)
+                    base = mops;
+                printf("%-14s %-9s %7d %10.2f %10.2f %7.2fx\n", strategy_names[strategy],
+                       use_threads ? "threads" : "processes", workers, elapsed * 1e9 / ops, mops, mops / base);
+            }
+        }
+    }
+
+    pthread_mutex_destroy(&b->plain);
+    pthread_mutex_destroy(&b->robust);
+    pthread_spin_destroy(&b->spin);
+    munmap(b, sizeof(bench_t));
+    return 0;
+}
+
+// Counts `increments` privately, renewing the lease on the way. Returns -1 if the lease was lost.
+int64_t lease_count(lease_table_t *t, uint32_t unit, uint64_t *token, long increments, int die)
+{
+    volatile uint64_t counter = 0;
+    for (long i = 0; i < increments; i++)
+    {
+        counter++;
+        if (die && i == increments / 2)
+        {
+            printf("[%d] dies in the middle of unit %u\n", getpid(), unit);
+            fflush(stdout);
+            kill(getpid(), SIGKILL);
+        }
+        if (i % LEASE_RENEW_EVERY == LEASE_RENEW_EVERY - 1 && lease_renew(t, unit, token) != 0)
+            return -1;
+    }
+    return counter;
+}
+
+void lease_worker(lease_table_t *t, long increments, int die)
+{
+    int units = 0, lost = 0;
+    for (;;)
+    {
+        uint64_t token;
+        int64_t unit = lease_claim(t, &token);
+        if (unit == LEASE_ALL_DONE)
+            break;
+        if (unit == LEASE_ALL_BUSY)
+        {
+            // whatever is left belongs to others, wait in case one of them dies
+            struct timespec ts = {0, LEASE_MS / 10 * 1000000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        // the dying worker gets killed in its second unit
+        int64_t value = lease_count(t, unit, &token, increments, die && units == 1);
+        if (value < 0 || lease_commit(t, unit, token, value) != 0)
+            lost++;
+        else
+            units++;
+    }
+    printf("[%d] committed %d units, lost %d leases\n", getpid(), units, lost);
+}
+
+// Like the demo, but the work is split into leased units, so the counter is exact even though a worker dies.
+int run_lease(int workers, long iterations)
+{
+    if (workers < 2)
+        workers = 2;
+    uint32_t units = workers * LEASE_UNITS_PER_WORKER;
+    long increments = iterations / LEASE_UNITS_PER_WORKER > 0 ? iterations / LEASE_UNITS_PER_WORKER : 1;
+    lease_table_t *t = mmap(NULL, lease_size(units), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED)
+    {
+        perror("mmap()");
+        return 1;
+    }
+    lease_init(t, units, LEASE_MS);
+    lease_add(t, units);
+
+    fflush(stdout);
+    for (int i = 0; i < workers; i++)
+    {
+        switch (fork())
+        {
+            case -1:
+                perror("fork()");
+                return 1;
+            case 0:
+                lease_worker(t, increments, i == 0);
+                exit(0);
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+
+    uint64_t counter = 0, value;
+    for (uint32_t i = 0; i < units; i++)
+    {
+        if (!lease_result(t, i, &value))
+        {
+            fprintf(stderr, "unit %u was never committed\n", i);
+            return 1;
+        }
+        counter += value;
+    }
+    printf("counter = %lu, expected %lu\n", counter, (uint64_t)units * increments);
+    munmap(t, lease_size(units));
+    return counter == (uint64_t)units * increments ? 0 : 1;
+}
+
+int run_demo(void)
+{
     shm_unlink("/sop_shm");
 
     int fd = shm_open("/sop_shm", O_CREAT | O_EXCL | O_RDWR, 0600);
@@ -177,3 +571,50 @@ int main()
     munmap(ptr, SHM_SIZE);
     return 0;
 }
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-b | -l] [-w workers] [-i iterations]\n", name);
+    fprintf(stderr, "without -b or -l runs the dying consumer demo\n");
+    fprintf(stderr, "-b - benchmark counter increments under different synchronisation strategies\n");
+    fprintf(stderr, "-l - count in leased units with one worker dying, at least 2 workers\n");
+    fprintf(stderr, "-w - maximum number of processes/threads, 1 <= w <= %d (default: CPUs, capped)\n", MAX_WORKERS);
+    fprintf(stderr, "-i - increments per worker (default: %d)\n", BENCH_ITERATIONS);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    srand(getpid());
+
+    int bench = 0, lease = 0, c;
+    // the default fits any machine, only an explicit -w above the limit is an error
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_workers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : cpus;
+    long iterations = BENCH_ITERATIONS;
+    while ((c = getopt(argc, argv, "blw:i:")) != -1)
+    {
+        switch (c)
+        {
+            case 'b':
+                bench = 1;
+                break;
+            case 'l':
+                lease = 1;
+                break;
+            case 'w':
+                max_workers = atoi(optarg);
+                break;
+            case 'i':
+                iterations = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc > optind || max_workers < 1 || max_workers > MAX_WORKERS || iterations < 1 || (bench && lease))
+        usage(argv[0]);
+    if (lease)
+        return run_lease(max_workers, iterations);
+    return bench ? run_bench(max_workers, iterations) : run_demo();
+}
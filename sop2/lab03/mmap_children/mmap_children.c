@@ -1,116 +1,392 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../../../sop_mc.h"
+
 #define ITERS 100000
-#define LOG_LEN 8
+#define MAX_CHILDREN 4096
+#define PROGRESS_MS 200
+#define READ_TRIES 1000  // attempts at a consistent copy of a record before it's reported as torn
+#define DEFAULT_LOG "./results.bin"
+#define CACHE_LINE 64
+#define LOG_MAGIC 0x474f4c434d504f53ULL  // "SOPMCLOG"
+#define LOG_VERSION 2
 
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
-void child_work(int id, float* out, char* log)
+volatile sig_atomic_t progress_due = 0;
+
+enum
+{
+    RECORD_WAITING,
+    RECORD_RUNNING,
+    RECORD_DONE
+};
+
+/**
+ * Header of the result file. The file is mapped by the parent and all the children, so it doubles as their shared
+ * memory. Another process can map it read-only to watch the computation (-r).
+ */
+typedef struct log_header
+{
+    uint64_t magic;  // written last, a file without it is not initialized yet
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t children;
+    uint32_t iters;  // points drawn by a child between updates of its record
+    double target_error;  // 0 - every child draws ITERS points once
+    uint64_t start_ns;
+    _Atomic uint32_t finished;  // set by the parent once all the children have exited
+    // totals of all children, updated after every round of ITERS points
+    _Alignas(CACHE_LINE) _Atomic uint64_t samples;
+    _Atomic uint64_t hits;
+} log_header_t;
+
+/**
+ * Result of one child, on a cache line of its own so children never write to the same line.
+ * seq is odd while the child updates the record, readers retry until they see the same even value before and after.
+ */
+typedef struct log_record
 {
-    int sample = 0;
-    srand(getpid());
-    int iters = ITERS;
-    while (iters-- > 0)
+    _Alignas(CACHE_LINE) _Atomic uint32_t seq;
+    _Atomic uint32_t state;
+    int32_t pid;
+    uint64_t samples;
+    uint64_t hits;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} log_record_t;
+
+_Static_assert(sizeof(log_record_t) == CACHE_LINE, "log_record_t should take exactly one cache line");
+
+size_t log_size(int n) { return sizeof(log_header_t) + n * sizeof(log_record_t); }
+
+log_record_t* log_records(log_header_t* log) { return (log_record_t*)(log + 1); }
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime");
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void record_begin(log_record_t* rec)
+{
+    atomic_fetch_add_explicit(&rec->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void record_end(log_record_t* rec) { atomic_fetch_add_explicit(&rec->seq, 1, memory_order_release); }
+
+/**
+ * Takes a consistent snapshot of a record which may be updated concurrently.
+ * A child killed in the middle of an update leaves seq odd forever, so the reader gives up when the child is gone or
+ * after READ_TRIES attempts.
+ * @return 0, or -1 if the copy in `out` may be torn.
+ */
+int record_read(log_record_t* rec, log_record_t* out)
+{
+    for (int i = 0; i < READ_TRIES; i++)
     {
-        double x = ((double)rand()) / RAND_MAX, y = ((double)rand()) / RAND_MAX;
-        if (x * x + y * y <= 1.0)
-            sample++;
+        uint32_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        memcpy(out, rec, sizeof(log_record_t));
+        atomic_thread_fence(memory_order_acquire);
+        if (seq % 2 == 0 && atomic_load_explicit(&rec->seq, memory_order_relaxed) == seq)
+            return 0;
+        if (out->pid > 0 && kill(out->pid, 0) && errno == ESRCH)
+            return -1;
+        sched_yield();
     }
-    out[id] = ((float)sample) / ITERS;
-    char buf[LOG_LEN + 1];
+    return -1;
+}
+
+void child_work(rng4_t* rng, log_header_t* log, log_record_t* rec)
+{
+    record_begin(rec);
+    rec->pid = getpid();
+    rec->start_ns = now_ns();
+    atomic_store(&rec->state, RECORD_RUNNING);
+    record_end(rec);
+
+    int done = 0;
+    while (!done)
+    {
+        uint64_t round_hits = mc_pi_hits(rng, ITERS);
+        record_begin(rec);
+        rec->samples += ITERS;
+        rec->hits += round_hits;
+        record_end(rec);
+        atomic_fetch_add(&log->hits, round_hits);
+        atomic_fetch_add(&log->samples, ITERS);
+        done = log->target_error <= 0.0 ||
+               mc_pi_stderr(atomic_load(&log->hits), atomic_load(&log->samples)) <= log->target_error;
+    }
+
+    record_begin(rec);
+    rec->end_ns = now_ns();
+    atomic_store(&rec->state, RECORD_DONE);
+    record_end(rec);
+}
+
+/**
+ * Prints the state of the computation. With `verbose` every child gets a line of its own.
+ * @return Number of children which are done.
+ */
+int print_log(log_header_t* log, int verbose)
+{
+    log_record_t* records = log_records(log);
+    uint64_t samples = 0, hits = 0, busy_ns = 0;
+    int running = 0, done = 0, torn = 0;
+    for (uint32_t i = 0; i < log->children; i++)
+    {
+        log_record_t rec;
+        if (record_read(&records[i], &rec))
+        {
+            torn++;
+            if (verbose)
+                printf("%5u: pid %7d torn, the child died in the middle of an update\n", i, rec.pid);
+            continue;
+        }
+        samples += rec.samples;
+        hits += rec.hits;
+        if (rec.state == RECORD_WAITING)
+            continue;
+        uint64_t end_ns = rec.state == RECORD_DONE ? rec.end_ns : now_ns();
+        busy_ns += end_ns - rec.start_ns;
+        if (rec.state == RECORD_DONE)
+            done++;
+        else
+            running++;
+        if (verbose)
+            printf("%5u: pid %7d %-7s %12lu samples, pi ~= %8.6f, %8.3f s\n", i, rec.pid,
+                   rec.state == RECORD_DONE ? "done" : "running", rec.samples, mc_pi(rec.hits, rec.samples),
+                   (end_ns - rec.start_ns) / 1e9);
+    }
+    double pi = mc_pi(hits, samples), error = mc_pi_stderr(hits, samples);
+    printf("%d/%u children done, %d running, %d torn, %lu samples, pi ~= %f +- %f, %.1f Msamples/s per child\n",
+           done, log->children, running, torn, samples, pi, MC_Z95 * error,
+           busy_ns > 0 ? samples * 1e3 / busy_ns : 0.0);
+    fflush(stdout);
+    return done;
+}
+
+int set_handler(void (*f)(int), int signo)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_handler = f;
+    if (sigaction(signo, &act, NULL) == -1)
+        return -1;
+    return 0;
+}
+
+void sigalrm_handler(int signo)
+{
+    (void)signo;
+    progress_due = 1;
+}
 
-    snprintf(buf, LOG_LEN + 1, "%7.5f\n", out[id] * 4.0f);
-    memcpy(log + id * LOG_LEN, buf, LOG_LEN);
+void set_progress_timer(int ms)
+{
+    struct itimerval timer = {{ms / 1000, ms % 1000 * 1000}, {ms / 1000, ms % 1000 * 1000}};
+    if (setitimer(ITIMER_REAL, &timer, NULL))
+        ERR("setitimer");
 }
 
-void parent_work(int n, float* data)
+// Sleeps in waitpid until all the children are gone, SIGALRM interrupts it for the progress lines.
+void parent_work(log_header_t* log)
 {
-    pid_t pid;
-    double sum = 0.0;
+    if (set_handler(sigalrm_handler, SIGALRM))
+        ERR("sigaction");
+    set_progress_timer(PROGRESS_MS);
     for (;;)
     {
-        pid = wait(NULL);
-        if (pid <= 0)
+        if (waitpid(-1, NULL, 0) >= 0)
+            continue;
+        if (errno == ECHILD)
+            break;
+        if (errno != EINTR)
+            ERR("waitpid");
+        if (progress_due)
         {
-            if (errno == ECHILD)
-                break;
-            ERR("wait");
+            progress_due = 0;
+            print_log(log, 0);
         }
     }
-    for (int i = 0; i < n; i++)
-        sum += data[i];
-    sum /= n;
-    printf("Pi is approximately %f\n", sum * 4);
+    set_progress_timer(0);
+    atomic_store(&log->finished, 1);
+    uint64_t samples = atomic_load(&log->samples), hits = atomic_load(&log->hits);
+    double pi = mc_pi(hits, samples), error = mc_pi_stderr(hits, samples);
+    printf("Pi is approximately %f\n", pi);
+    printf("95%% confidence interval: [%f, %f] after %lu samples in %.3f s\n", pi - MC_Z95 * error,
+           pi + MC_Z95 * error, samples, (now_ns() - log->start_ns) / 1e9);
 }
 
-void create_children(int n, float* data, char* log)
+void create_children(int n, log_header_t* log)
 {
+    // each child inherits its own streams, jumped apart in the sequence of a single generator
+    rng_t base;
+    rng_seed(&base, time(NULL));
+    fflush(stdout);
     for (int i = 0; i < n; i++)
     {
+        rng4_t rng;
+        rng4_init(&rng, &base);
         int pid;
         if ((pid = fork()) == -1)
             ERR("fork");
         if (pid == 0)
         {
-            child_work(i, data, log);
+            child_work(&rng, log, &log_records(log)[i]);
             exit(EXIT_SUCCESS);
         }
     }
 }
 
+/**
+ * Maps the result file of another (possibly still running) computation and follows it: a progress line every
+ * PROGRESS_MS until the computation is over, then the result of every child. The computing processes hold a lock on
+ * the file, which goes away with them also when they are killed.
+ */
+int read_log(char* path)
+{
+    int fd;
+    if ((fd = open(path, O_RDONLY)) == -1)
+        ERR("open");
+    struct stat st;
+    if (fstat(fd, &st))
+        ERR("fstat");
+    if ((size_t)st.st_size < sizeof(log_header_t))
+    {
+        fprintf(stderr, "%s: not a result file\n", path);
+        return EXIT_FAILURE;
+    }
+    log_header_t* log;
+    if ((log = (log_header_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        ERR("mmap");
+    if (log->magic != LOG_MAGIC || log->version != LOG_VERSION || log->record_size != sizeof(log_record_t) ||
+        (size_t)st.st_size < log_size(log->children))
+    {
+        fprintf(stderr, "%s: not a result file of this version\n", path);
+        return EXIT_FAILURE;
+    }
+    while (!atomic_load(&log->finished))
+    {
+        if (flock(fd, LOCK_SH | LOCK_NB) == 0)
+        {
+            if (!atomic_load(&log->finished))
+                printf("the computation was interrupted\n");
+            break;
+        }
+        if (errno != EWOULDBLOCK)
+            ERR("flock");
+        print_log(log, 0);
+        struct timespec ts = {PROGRESS_MS / 1000, PROGRESS_MS % 1000 * 1000000L};
+        if (nanosleep(&ts, NULL) && errno != EINTR)
+            ERR("nanosleep");
+    }
+    print_log(log, 1);
+    if (munmap(log, st.st_size))
+        ERR("munmap");
+    if (close(fd))
+        ERR("close");
+    return EXIT_SUCCESS;
+}
+
 void usage(char* name)
 {
-    fprintf(stderr, "USAGE: %s n\n", name);
-    fprintf(stderr, "1 <= n <= 30 - number of children\n");
+    fprintf(stderr, "USAGE: %s [-f file] n [target_error]\n", name);
+    fprintf(stderr, "       %s -r [-f file]\n", name);
+    fprintf(stderr, "1 <= n <= %d - number of children\n", MAX_CHILDREN);
+    fprintf(stderr, "target_error - draw points until the standard error of pi drops below it\n");
+    fprintf(stderr, "-f - result file, default %s\n", DEFAULT_LOG);
+    fprintf(stderr, "-r - follow the result file of a running computation until it's over, then print it\n");
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv)
 {
+    char* path = DEFAULT_LOG;
+    int read_only = 0, c;
+    while ((c = getopt(argc, argv, "f:r")) != -1)
+    {
+        switch (c)
+        {
+            case 'f':
+                path = optarg;
+                break;
+            case 'r':
+                read_only = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (read_only)
+    {
+        if (argc != optind)
+            usage(argv[0]);
+        return read_log(path);
+    }
+
     int n;
-    if (argc != 2)
+    if (argc - optind != 1 && argc - optind != 2)
+        usage(argv[0]);
+    n = atoi(argv[optind]);
+    if (n <= 0 || n > MAX_CHILDREN)
         usage(argv[0]);
-    n = atoi(argv[1]);
-    if (n <= 0 || n > 30)
+    double target_error = argc - optind == 2 ? atof(argv[optind + 1]) : 0.0;
+    if (argc - optind == 2 && target_error <= 0.0)
         usage(argv[0]);
 
     int log_fd;
-    if ((log_fd = open("./log.txt", O_CREAT | O_RDWR | O_TRUNC, -1)) == -1)
+    if ((log_fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644)) == -1)
         ERR("open");
+    // held by the parent and the children (they share it) for as long as any of them lives, see read_log
+    if (flock(log_fd, LOCK_EX))
+        ERR("flock");
     // ftruncate - sets the file to a specific size (despite the name...)
-    if (ftruncate(log_fd, n * LOG_LEN))
+    if (ftruncate(log_fd, log_size(n)))
         ERR("ftruncate");
-    char* log;
-    if ((log = (char*)mmap(NULL, n * LOG_LEN, PROT_WRITE | PROT_READ, MAP_SHARED, log_fd, 0)) == MAP_FAILED)
-        ERR("mmap");
-    // Manpage: "The mmap() function shall add an extra reference to the file associated with the file descriptor
-    // which is not removed by a subsequent close()"
-    if (close(log_fd))
-        ERR("close");
-    float* data;
-    if ((data = (float*)mmap(NULL, n * sizeof(float), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
-        MAP_FAILED)
+    log_header_t* log;
+    if ((log = (log_header_t*)mmap(NULL, log_size(n), PROT_WRITE | PROT_READ, MAP_SHARED, log_fd, 0)) == MAP_FAILED)
         ERR("mmap");
+    // the file was just truncated, so everything is already zeroed
+    log->version = LOG_VERSION;
+    log->record_size = sizeof(log_record_t);
+    log->children = n;
+    log->iters = ITERS;
+    log->target_error = target_error;
+    log->start_ns = now_ns();
+    atomic_thread_fence(memory_order_release);
+    log->magic = LOG_MAGIC;
 
-    create_children(n, data, log);
-    parent_work(n, data);
+    create_children(n, log);
+    parent_work(log);
 
-    if (munmap(data, n * sizeof(float)))
-        ERR("munmap");
     // make sure that the data is actually written to the backing file
-    if (msync(log, n * LOG_LEN, MS_SYNC))
+    if (msync(log, log_size(n), MS_SYNC))
         ERR("msync");
-    if (munmap(log, n * LOG_LEN))
+    if (munmap(log, log_size(n)))
         ERR("munmap");
+    if (close(log_fd))
+        ERR("close");
 
     return EXIT_SUCCESS;
 }
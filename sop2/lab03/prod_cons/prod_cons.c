@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,9 +11,18 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "../sop_mpmc.h"
+#include "../sop_slab.h"
+
 #define BUFFER_SIZE 10
 #define ITERATIONS 20
 
+#define DEFAULT_ITEMS 1000000
+#define DEFAULT_CAPACITY 1024
+#define DEFAULT_BATCH 16
+#define DEFAULT_MAX_LEN 1024
+#define POISON UINT64_MAX
+
 typedef struct context
 {
     pthread_mutex_t mtx;
@@ -67,33 +78,282 @@ void consumer(context_t *ctx)
     }
 }
 
-int main()
+typedef struct mpmc_stats
 {
-    srand(getpid());
+    _Alignas(MPMC_CACHE_LINE) _Atomic uint64_t consumed;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t corrupted;
+} mpmc_stats_t;
 
+typedef struct mpmc_args
+{
+    int producers;
+    int consumers;
+    int items;
+    int capacity;
+    int batch;
+    int die;
+    uint64_t slab_size;  // 0 - items are passed in the queue slots
+    uint32_t max_len;
+} mpmc_args_t;
+
+void *map_shm(size_t size)
+{
     shm_unlink("/sop_shm");
 
     int fd = shm_open("/sop_shm", O_CREAT | O_EXCL | O_RDWR, 0600);
     if (fd < 0)
     {
         perror("shm_open()");
-        return 1;
+        return NULL;
     }
 
-    if (ftruncate(fd, SHM_SIZE) < 0)
+    if (ftruncate(fd, size) < 0)
     {
         perror("ftruncate()");
-        return 1;
+        close(fd);
+        return NULL;
     }
 
-    void *ptr = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (ptr == MAP_FAILED)
     {
         perror("mmap()");
-        return 1;
+        close(fd);
+        return NULL;
     }
 
     close(fd);
+    shm_unlink("/sop_shm");
+    return ptr;
+}
+
+// writes the item number followed by a recognizable pattern into the payload
+void fill_payload(unsigned char *payload, uint32_t len, uint64_t value)
+{
+    memcpy(payload, &value, sizeof(value));
+    memset(payload + sizeof(value), (unsigned char)value, len - sizeof(value));
+}
+
+int check_payload(const unsigned char *payload, uint32_t len, uint64_t *value)
+{
+    memcpy(value, payload, sizeof(*value));
+    for (uint32_t i = sizeof(*value); i < len; i++)
+    {
+        if (payload[i] != (unsigned char)*value)
+            return 0;
+    }
+    return 1;
+}
+
+void mpmc_producer(mpmc_queue_t *q, slab_t *slab, mpmc_args_t *args, int die)
+{
+    int me = mpmc_join(q);
+    if (me < 0)
+    {
+        perror("mpmc_join()");
+        exit(1);
+    }
+
+    unsigned seed = getpid();
+    uint64_t buf[args->batch];
+    for (int i = 0; i < args->items; i += args->batch)
+    {
+        int n = (args->items - i < args->batch) ? args->items - i : args->batch;
+
+        if (die && i >= args->items / 2)
+        {
+            // claim the slots and die before publishing them
+            uint64_t pos;
+            while (mpmc_reserve(q, me, MPMC_PUSH, n, &pos) == 0)
+                sched_yield();
+            printf("producer %d exits mid-push!\n", getpid());
+            fflush(stdout);
+            kill(getpid(), SIGKILL);
+        }
+
+        int ready = 0;
+        for (int j = 0; j < n; j++)
+        {
+            if (slab == NULL)
+            {
+                buf[ready++] = i + j + 1;
+                continue;
+            }
+            uint32_t len = sizeof(uint64_t) + rand_r(&seed) % (args->max_len - sizeof(uint64_t) + 1);
+            unsigned char *payload = slab_try_reserve(slab, len, &buf[ready]);
+            if (payload == NULL && errno == EAGAIN)
+            {
+                // the consumers can free space only after the already written messages are published
+                mpmc_push(q, me, buf, ready);
+                ready = 0;
+                payload = slab_reserve(slab, len, &buf[ready]);
+            }
+            if (payload == NULL)
+            {
+                perror("slab_reserve()");
+                exit(1);
+            }
+            fill_payload(payload, len, i + j + 1);
+            ready++;
+        }
+        mpmc_push(q, me, buf, ready);
+    }
+    mpmc_leave(q, me);
+}
+
+void mpmc_consumer(mpmc_queue_t *q, slab_t *slab, mpmc_stats_t *stats, int batch)
+{
+    int me = mpmc_join(q);
+    if (me < 0)
+    {
+        perror("mpmc_join()");
+        exit(1);
+    }
+
+    uint64_t buf[batch];
+    uint64_t consumed = 0, sum = 0, bytes = 0, corrupted = 0;
+    int done = 0;
+    while (!done)
+    {
+        uint32_t n = mpmc_pop(q, me, buf, batch);
+        uint32_t extra_poison = 0;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (buf[i] == POISON)
+            {
+                if (done)
+                    extra_poison++;
+                done = 1;
+                continue;
+            }
+            uint64_t value = buf[i];
+            if (slab != NULL)
+            {
+                uint32_t len;
+                unsigned char *payload = slab_payload(slab, buf[i], &len);
+                if (!check_payload(payload, len, &value))
+                    corrupted++;
+                bytes += len;
+                if (slab_release(slab, buf[i]) != 0)
+                {
+                    perror("slab_release()");
+                    exit(1);
+                }
+            }
+            consumed++;
+            sum += value;
+        }
+        // the pills belong to the other consumers
+        for (uint32_t i = 0; i < extra_poison; i++)
+            mpmc_push(q, me, &(uint64_t){POISON}, 1);
+    }
+
+    atomic_fetch_add(&stats->consumed, consumed);
+    atomic_fetch_add(&stats->sum, sum);
+    atomic_fetch_add(&stats->bytes, bytes);
+    atomic_fetch_add(&stats->corrupted, corrupted);
+    mpmc_leave(q, me);
+}
+
+int run_mpmc(mpmc_args_t *args)
+{
+    int participants = args->producers + args->consumers + 1;
+    size_t queue_size = mpmc_size(args->capacity, participants);
+    size_t size = sizeof(mpmc_stats_t) + queue_size + (args->slab_size ? slab_size(args->slab_size) : 0);
+    void *ptr = map_shm(size);
+    if (ptr == NULL)
+        return 1;
+
+    mpmc_stats_t *stats = (mpmc_stats_t *)ptr;
+    mpmc_queue_t *q = (mpmc_queue_t *)((char *)ptr + sizeof(mpmc_stats_t));
+    memset(stats, 0, sizeof(mpmc_stats_t));
+    if (mpmc_init(q, args->capacity, participants) != 0)
+    {
+        perror("mpmc_init()");
+        return 1;
+    }
+    slab_t *slab = NULL;
+    if (args->slab_size)
+    {
+        slab = (slab_t *)((char *)q + queue_size);
+        if (slab_init(slab, args->slab_size) != 0)
+        {
+            perror("slab_init()");
+            return 1;
+        }
+        if (args->max_len > slab_max_len(slab))
+        {
+            fprintf(stderr, "messages of %u bytes do not fit into the segment\n", args->max_len);
+            return 1;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t producer_pids[args->producers];
+    for (int i = 0; i < args->producers + args->consumers; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork()");
+            return 1;
+        }
+        if (pid == 0)
+        {
+            if (i < args->producers)
+                mpmc_producer(q, slab, args, args->die && i == 0);
+            else
+                mpmc_consumer(q, slab, stats, args->batch);
+            munmap(ptr, size);
+            exit(0);
+        }
+        if (i < args->producers)
+            producer_pids[i] = pid;
+    }
+
+    int me = mpmc_join(q);
+    if (me < 0)
+    {
+        perror("mpmc_join()");
+        return 1;
+    }
+    for (int i = 0; i < args->producers; i++)
+        waitpid(producer_pids[i], NULL, 0);
+    for (int i = 0; i < args->consumers; i++)
+        mpmc_push(q, me, &(uint64_t){POISON}, 1);
+    mpmc_leave(q, me);
+    while (wait(NULL) > 0)
+        ;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    uint64_t produced = (uint64_t)args->producers * args->items;
+    uint64_t expected_sum = produced * (args->items + 1) / 2;
+    uint64_t consumed = atomic_load(&stats->consumed);
+    printf("consumed %lu of %lu items (sum %s), %lu slots skipped\n", consumed, produced,
+           atomic_load(&stats->sum) == expected_sum ? "ok" : "differs", atomic_load(&q->skipped));
+    printf("%.3f s, %.0f items/s\n", elapsed, consumed / elapsed);
+    if (slab != NULL)
+    {
+        printf("%lu payload bytes, %.1f MiB/s, %lu corrupted\n", atomic_load(&stats->bytes),
+               atomic_load(&stats->bytes) / elapsed / (1 << 20), atomic_load(&stats->corrupted));
+        slab_destroy(slab);
+    }
+
+    mpmc_destroy(q);
+    munmap(ptr, size);
+    return 0;
+}
+
+int run_single(void)
+{
+    void *ptr = map_shm(SHM_SIZE);
+    if (ptr == NULL)
+        return 1;
 
     context_t *ctx = (context_t *)ptr;
     memset(ctx, 0, sizeof(context_t));
@@ -153,3 +413,69 @@ int main()
     munmap(ptr, SHM_SIZE);
     return 0;
 }
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-p producers -c consumers] [-n items] [-q capacity] [-b batch] [-k] [-s bytes [-l len]]\n",
+            name);
+    fprintf(stderr, "without -p/-c runs a single producer and consumer over a mutex-protected buffer\n");
+    fprintf(stderr, "-p, -c - number of producer and consumer processes sharing a lock-free queue\n");
+    fprintf(stderr, "-n - items per producer (default: %d)\n", DEFAULT_ITEMS);
+    fprintf(stderr, "-q - queue capacity, a power of two (default: %d)\n", DEFAULT_CAPACITY);
+    fprintf(stderr, "-b - items pushed/popped at once (default: %d)\n", DEFAULT_BATCH);
+    fprintf(stderr, "-k - kill the first producer in the middle of a push\n");
+    fprintf(stderr, "-s - pass variable-size messages in place through a shared segment of that many bytes\n");
+    fprintf(stderr, "-l - maximum message length (default: %d)\n", DEFAULT_MAX_LEN);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    srand(getpid());
+
+    mpmc_args_t args = {.items = DEFAULT_ITEMS,
+                        .capacity = DEFAULT_CAPACITY,
+                        .batch = DEFAULT_BATCH,
+                        .max_len = DEFAULT_MAX_LEN};
+    int c;
+    while ((c = getopt(argc, argv, "p:c:n:q:b:ks:l:")) != -1)
+    {
+        switch (c)
+        {
+            case 'p':
+                args.producers = atoi(optarg);
+                break;
+            case 'c':
+                args.consumers = atoi(optarg);
+                break;
+            case 'n':
+                args.items = atoi(optarg);
+                break;
+            case 'q':
+                args.capacity = atoi(optarg);
+                break;
+            case 'b':
+                args.batch = atoi(optarg);
+                break;
+            case 'k':
+                args.die = 1;
+                break;
+            case 's':
+                args.slab_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                args.max_len = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc > optind)
+        usage(argv[0]);
+    if (args.producers == 0 && args.consumers == 0)
+        return run_single();
+    if (args.producers <= 0 || args.consumers <= 0 || args.items <= 0 || args.batch <= 0 || args.capacity <= 0 ||
+        (args.capacity & (args.capacity - 1)) != 0 || args.max_len < sizeof(uint64_t))
+        usage(argv[0]);
+    return run_mpmc(&args);
+}
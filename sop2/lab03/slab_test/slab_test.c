@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../sop_slab.h"
+
+#define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), exit(EXIT_FAILURE))
+
+#define SEGMENT 1500
+#define ROUNDS 3
+
+/**
+ * Leaves the slab empty with head and tail at `len` bytes of payload (plus a header) past where they were, then sends
+ * messages of slab_max_len bytes through it. Every one of them has to fit without waiting.
+ * @return Number of messages which did not fit.
+ */
+int drain_at(slab_t *s, uint32_t len)
+{
+    uint64_t desc;
+    unsigned char *payload;
+    if ((payload = slab_try_reserve(s, len, &desc)) == NULL)
+        ERR("slab_try_reserve");
+    memset(payload, 0xaa, len);
+    if (slab_release(s, desc))
+        ERR("slab_release");
+
+    int failed = 0;
+    uint32_t max_len = slab_max_len(s);
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        if ((payload = slab_try_reserve(s, max_len, &desc)) == NULL)
+        {
+            if (errno != EAGAIN)
+                ERR("slab_try_reserve");
+            fprintf(stderr, "%u bytes did not fit into the empty slab, drained after %u bytes\n", max_len, len);
+            failed++;
+            continue;
+        }
+        memset(payload, i, max_len);
+        if (slab_release(s, desc))
+            ERR("slab_release");
+    }
+    return failed;
+}
+
+int main(void)
+{
+    slab_t *s = mmap(NULL, slab_size(SEGMENT), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED)
+        ERR("mmap");
+    if (slab_init(s, SEGMENT))
+        ERR("slab_init");
+
+    // odd lengths, so that the ring drains at every kind of offset, including around the middle of the segment
+    int failed = 0, runs = 0;
+    for (uint32_t len = 1; len < slab_max_len(s); len += 37, runs++)
+        failed += drain_at(s, len);
+
+    slab_destroy(s);
+    if (munmap(s, slab_size(SEGMENT)))
+        ERR("munmap");
+    if (failed > 0)
+    {
+        printf("FAILED: %d of %d max-length messages did not fit\n", failed, runs * ROUNDS);
+        return EXIT_FAILURE;
+    }
+    printf("OK: %d max-length messages after %d drains\n", runs * ROUNDS, runs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+#ifndef SOP_LEASE_H
+#define SOP_LEASE_H
+
+// Crash-tolerant distribution of work units between processes.
+//
+// Every unit is a single 64-bit word in shared memory, so claiming, renewing and committing it are single
+// compare-and-swaps and no lock is ever held while a unit is processed:
+//  - 0 - nobody has claimed the unit yet,
+//  - epoch:16 | deadline:47 - claimed until the deadline (CLOCK_MONOTONIC milliseconds),
+//  - LEASE_DONE | value - committed with a 63-bit result.
+// A worker keeps its partial result private and commits it only if the word still holds the token it got when
+// claiming the unit. If the worker dies or stalls, the lease expires and any other worker reclaims the unit with
+// the next epoch, so the late commit of the old holder fails. Every unit is therefore counted exactly once and
+// nobody has to stop to clean up after a dead process.
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define LEASE_DONE (1ULL << 63)
+#define LEASE_DEADLINE_BITS 47
+#define LEASE_DEADLINE_MASK ((1ULL << LEASE_DEADLINE_BITS) - 1)
+#define LEASE_EPOCH_MASK 0xffffULL
+
+// lease_claim results other than a unit index
+#define LEASE_ALL_DONE -1
+#define LEASE_ALL_BUSY -2  // the rest of the units is leased to other workers, try again later
+
+typedef struct lease_table
+{
+    _Atomic uint32_t count;
+    uint32_t capacity;
+    uint64_t lease_ms;
+    _Atomic uint32_t hint;  // all the units before it are done
+    _Atomic uint64_t units[];
+} lease_table_t;
+
+uint64_t lease_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+size_t lease_size(uint32_t capacity) { return sizeof(lease_table_t) + capacity * sizeof(uint64_t); }
+
+// Units are held for `lease_ms` after they are claimed or renewed.
+void lease_init(lease_table_t *t, uint32_t capacity, uint64_t lease_ms)
+{
+    memset(t, 0, lease_size(capacity));
+    t->capacity = capacity;
+    t->lease_ms = lease_ms;
+}
+
+// Appends n new units. Returns the index of the first one, or -1 if the table is full.
+int64_t lease_add(lease_table_t *t, uint32_t n)
+{
+    uint32_t count = atomic_load(&t->count);
+    do
+    {
+        if (n > t->capacity - count)
+            return -1;
+    } while (!atomic_compare_exchange_weak(&t->count, &count, count + n));
+    return count;
+}
+
+uint64_t lease_token(uint64_t old, uint64_t deadline)
+{
+    uint64_t epoch = ((old >> LEASE_DEADLINE_BITS) + 1) & LEASE_EPOCH_MASK;
+    return epoch << LEASE_DEADLINE_BITS | (deadline & LEASE_DEADLINE_MASK);
+}
+
+// Claims a unit which is free or whose lease has expired. Stores the lease token in *token and returns the unit,
+// LEASE_ALL_DONE when every unit is committed or LEASE_ALL_BUSY when the remaining units are leased to others.
+int64_t lease_claim(lease_table_t *t, uint64_t *token)
+{
+    uint64_t now = lease_now_ms();
+    uint32_t count = atomic_load(&t->count), first = atomic_load(&t->hint);
+    int busy = 0;
+    for (uint32_t i = first; i < count; i++)
+    {
+        uint64_t w = atomic_load(&t->units[i]);
+        if (w & LEASE_DONE)
+        {
+            if (i == first && atomic_compare_exchange_strong(&t->hint, &first, i + 1))
+                first = i + 1;
+            continue;
+        }
+        if (w != 0 && (w & LEASE_DEADLINE_MASK) > now)
+        {
+            busy = 1;
+            continue;
+        }
+        uint64_t claimed = lease_token(w, now + t->lease_ms);
+        if (atomic_compare_exchange_strong(&t->units[i], &w, claimed))
+        {
+            *token = claimed;
+            return i;
+        }
+        // somebody else got it first, it's busy or done now
+        busy = busy || !(w & LEASE_DONE);
+    }
+    return busy ? LEASE_ALL_BUSY : LEASE_ALL_DONE;
+}
+
+// Extends the lease. Returns 0, or -1 if the unit was reclaimed by someone else in the meantime.
+int lease_renew(lease_table_t *t, uint32_t unit, uint64_t *token)
+{
+    uint64_t expected = *token;
+    uint64_t renewed = (*token & ~LEASE_DEADLINE_MASK) | ((lease_now_ms() + t->lease_ms) & LEASE_DEADLINE_MASK);
+    if (!atomic_compare_exchange_strong(&t->units[unit], &expected, renewed))
+        return -1;
+    *token = renewed;
+    return 0;
+}
+
+// Publishes the result of the unit. Returns 0, or -1 if the lease was lost and the result must be thrown away.
+int lease_commit(lease_table_t *t, uint32_t unit, uint64_t token, uint64_t value)
+{
+    return atomic_compare_exchange_strong(&t->units[unit], &token, LEASE_DONE | value) ? 0 : -1;
+}
+
+// Returns 1 and stores the result in *value if the unit is committed, 0 otherwise.
+int lease_result(lease_table_t *t, uint32_t unit, uint64_t *value)
+{
+    uint64_t w = atomic_load(&t->units[unit]);
+    *value = w & ~LEASE_DONE;
+    return (w & LEASE_DONE) != 0;
+}
+
+#endif
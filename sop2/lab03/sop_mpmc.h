@@ -0,0 +1,429 @@
+#ifndef SOP_MPMC_H
+#define SOP_MPMC_H
+
+// Bounded multi-producer/multi-consumer queue living in shared memory.
+//
+// Every slot carries a sequence number (D. Vyukov's bounded MPMC queue): a producer may write slot `pos` once its
+// sequence equals `pos`, a consumer may read it once the sequence equals `pos + 1`. Producers and consumers only
+// contend on their own head counter, so nothing serialises on a single mutex.
+//
+// Each process joins the queue as a participant and holds a robust mutex for as long as it lives. Before claiming
+// slots it records the claim in its participant entry, so when a process gets killed between claiming and
+// publishing, the others can notice (the mutex reports EOWNERDEAD) and unblock the abandoned slots.
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define MPMC_CACHE_LINE 64
+#define MPMC_SPINS 1024
+#define MPMC_REPAIRING UINT64_MAX  // sequence of a slot a repairer has taken over, no one else can claim it
+
+enum
+{
+    MPMC_FREE,
+    MPMC_ALIVE,
+    MPMC_DEAD
+};
+
+enum
+{
+    MPMC_IDLE,
+    MPMC_PUSH,
+    MPMC_POP
+};
+
+typedef struct mpmc_slot
+{
+    _Atomic uint64_t seq;
+    uint64_t value;
+    int skip;  // set when the producer died before writing the value
+} mpmc_slot_t;
+
+typedef struct mpmc_participant
+{
+    _Alignas(MPMC_CACHE_LINE) pthread_mutex_t alive;
+    _Atomic int state;
+    // slots [pos, pos + n) which this participant is about to claim or has claimed,
+    // claim_seq is odd while the three of them are being written
+    _Atomic uint32_t claim_seq;
+    _Atomic int kind;
+    _Atomic uint64_t pos;
+    _Atomic uint32_t n;
+} mpmc_participant_t;
+
+typedef struct mpmc_queue
+{
+    uint64_t capacity;
+    uint64_t mask;
+    uint32_t max_participants;
+    _Atomic uint64_t skipped;
+
+    _Alignas(MPMC_CACHE_LINE) _Atomic uint64_t enqueue_pos;
+    _Alignas(MPMC_CACHE_LINE) _Atomic uint64_t dequeue_pos;
+    _Alignas(MPMC_CACHE_LINE) unsigned char data[];  // participants, then slots
+} mpmc_queue_t;
+
+size_t mpmc_size(uint64_t capacity, uint32_t max_participants)
+{
+    return sizeof(mpmc_queue_t) + max_participants * sizeof(mpmc_participant_t) + capacity * sizeof(mpmc_slot_t);
+}
+
+mpmc_participant_t *mpmc_participant(mpmc_queue_t *q, int id) { return (mpmc_participant_t *)q->data + id; }
+
+mpmc_slot_t *mpmc_slot(mpmc_queue_t *q, uint64_t pos)
+{
+    mpmc_slot_t *slots = (mpmc_slot_t *)(q->data + q->max_participants * sizeof(mpmc_participant_t));
+    return &slots[pos & q->mask];
+}
+
+// Initializes the queue in memory of at least mpmc_size() bytes. Capacity must be a power of two.
+// Returns 0 on success, -1 with errno set otherwise.
+int mpmc_init(mpmc_queue_t *q, uint64_t capacity, uint32_t max_participants)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 || max_participants == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(q, 0, mpmc_size(capacity, max_participants));
+    q->capacity = capacity;
+    q->mask = capacity - 1;
+    q->max_participants = max_participants;
+    for (uint64_t i = 0; i < capacity; i++)
+        atomic_init(&mpmc_slot(q, i)->seq, i);
+
+    pthread_mutexattr_t attr;
+    int err;
+    if ((err = pthread_mutexattr_init(&attr)) != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (uint32_t i = 0; i < max_participants; i++)
+    {
+        if ((err = pthread_mutex_init(&mpmc_participant(q, i)->alive, &attr)) != 0)
+        {
+            pthread_mutexattr_destroy(&attr);
+            errno = err;
+            return -1;
+        }
+    }
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+void mpmc_destroy(mpmc_queue_t *q)
+{
+    for (uint32_t i = 0; i < q->max_participants; i++)
+        pthread_mutex_destroy(&mpmc_participant(q, i)->alive);
+}
+
+// Registers the calling process. Must be called after fork(), the returned id is passed to every other call.
+// Returns -1 with errno set to ENOSPC when all participant entries are taken.
+int mpmc_join(mpmc_queue_t *q)
+{
+    for (uint32_t i = 0; i < q->max_participants; i++)
+    {
+        mpmc_participant_t *p = mpmc_participant(q, i);
+        int expected = MPMC_FREE;
+        if (!atomic_compare_exchange_strong(&p->state, &expected, MPMC_ALIVE))
+            continue;
+        atomic_store(&p->kind, MPMC_IDLE);
+        int err = pthread_mutex_lock(&p->alive);
+        if (err == EOWNERDEAD)
+            pthread_mutex_consistent(&p->alive);
+        else if (err != 0)
+        {
+            atomic_store(&p->state, MPMC_FREE);
+            errno = err;
+            return -1;
+        }
+        return (int)i;
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+void mpmc_leave(mpmc_queue_t *q, int me)
+{
+    mpmc_participant_t *p = mpmc_participant(q, me);
+    atomic_store(&p->kind, MPMC_IDLE);
+    atomic_store(&p->state, MPMC_FREE);
+    pthread_mutex_unlock(&p->alive);
+}
+
+// Returns 0 if the participant is known to be gone, 1 otherwise.
+int mpmc_alive(mpmc_queue_t *q, int id)
+{
+    mpmc_participant_t *p = mpmc_participant(q, id);
+    int state = atomic_load(&p->state);
+    if (state != MPMC_ALIVE)
+        return 0;
+    switch (pthread_mutex_trylock(&p->alive))
+    {
+        case EBUSY:
+            return 1;
+        case EOWNERDEAD:
+            pthread_mutex_consistent(&p->alive);
+            atomic_store(&p->state, MPMC_DEAD);
+            pthread_mutex_unlock(&p->alive);
+            return 0;
+        case 0:
+            // the participant is just joining or leaving
+            pthread_mutex_unlock(&p->alive);
+            return atomic_load(&p->state) == MPMC_ALIVE;
+        default:
+            return 1;
+    }
+}
+
+// Publishes a claim, a reader which sees claim_seq change in the meantime reads it again.
+void mpmc_set_claim(mpmc_participant_t *p, int kind, uint64_t pos, uint32_t n)
+{
+    uint32_t seq = atomic_load_explicit(&p->claim_seq, memory_order_relaxed);
+    atomic_store(&p->claim_seq, seq + 1);
+    atomic_store(&p->pos, pos);
+    atomic_store(&p->n, n);
+    atomic_store(&p->kind, kind);
+    atomic_store(&p->claim_seq, seq + 2);
+}
+
+// Reads the claim of participant `id` in one piece. Returns 0, or -1 if the participant died while writing it (and
+// so before it could claim anything).
+int mpmc_read_claim(mpmc_queue_t *q, int id, int *kind, uint64_t *pos, uint32_t *n)
+{
+    mpmc_participant_t *p = mpmc_participant(q, id);
+    for (;;)
+    {
+        uint32_t seq = atomic_load(&p->claim_seq);
+        if (seq & 1)
+        {
+            if (!mpmc_alive(q, id))
+                return -1;
+            sched_yield();
+            continue;
+        }
+        *kind = atomic_load(&p->kind);
+        *pos = atomic_load(&p->pos);
+        *n = atomic_load(&p->n);
+        if (atomic_load(&p->claim_seq) == seq)
+            return 0;
+    }
+}
+
+// Reserves up to `max` consecutive slots for pushing (kind == MPMC_PUSH) or popping (kind == MPMC_POP).
+// Returns the number of reserved slots (0 if the queue is full/empty) and stores the first position in *pos.
+uint32_t mpmc_reserve(mpmc_queue_t *q, int me, int kind, uint32_t max, uint64_t *pos)
+{
+    mpmc_participant_t *p = mpmc_participant(q, me);
+    _Atomic uint64_t *head = (kind == MPMC_PUSH) ? &q->enqueue_pos : &q->dequeue_pos;
+    uint64_t offset = (kind == MPMC_PUSH) ? 0 : 1;
+
+    uint64_t start = atomic_load_explicit(head, memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t n = 0;
+        int64_t diff = 0;
+        while (n < max)
+        {
+            uint64_t seq = atomic_load_explicit(&mpmc_slot(q, start + n)->seq, memory_order_acquire);
+            diff = (int64_t)(seq - (start + n + offset));
+            if (diff != 0)
+                break;
+            n++;
+        }
+        if (n == 0)
+        {
+            if (diff < 0)
+            {
+                atomic_store(&p->kind, MPMC_IDLE);
+                return 0;
+            }
+            start = atomic_load_explicit(head, memory_order_relaxed);
+            continue;
+        }
+
+        // the claim has to be visible before the slots become ours
+        mpmc_set_claim(p, kind, start, n);
+        if (atomic_compare_exchange_weak(head, &start, start + n))
+        {
+            *pos = start;
+            return n;
+        }
+    }
+}
+
+void mpmc_commit_push(mpmc_queue_t *q, int me, uint64_t pos, const uint64_t *items, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        mpmc_slot_t *slot = mpmc_slot(q, pos + i);
+        slot->value = items[i];
+        slot->skip = 0;
+        atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+    }
+    atomic_store_explicit(&mpmc_participant(q, me)->kind, MPMC_IDLE, memory_order_release);
+}
+
+// Returns the number of items copied out, which is lower than n when some of the slots were abandoned.
+uint32_t mpmc_commit_pop(mpmc_queue_t *q, int me, uint64_t pos, uint64_t *items, uint32_t n)
+{
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        mpmc_slot_t *slot = mpmc_slot(q, pos + i);
+        if (!slot->skip)
+            items[out++] = slot->value;
+        atomic_store_explicit(&slot->seq, pos + i + q->capacity, memory_order_release);
+    }
+    atomic_store_explicit(&mpmc_participant(q, me)->kind, MPMC_IDLE, memory_order_release);
+    return out;
+}
+
+uint32_t mpmc_try_push(mpmc_queue_t *q, int me, const uint64_t *items, uint32_t n)
+{
+    uint64_t pos;
+    uint32_t k = mpmc_reserve(q, me, MPMC_PUSH, n, &pos);
+    if (k > 0)
+        mpmc_commit_push(q, me, pos, items, k);
+    return k;
+}
+
+uint32_t mpmc_try_pop(mpmc_queue_t *q, int me, uint64_t *items, uint32_t max)
+{
+    uint64_t pos;
+    uint32_t k = mpmc_reserve(q, me, MPMC_POP, max, &pos);
+    if (k == 0)
+        return 0;
+    return mpmc_commit_pop(q, me, pos, items, k);
+}
+
+// Returns 1 if slot `pos` was claimed by a dead participant and by no living one.
+int mpmc_claimed_by_dead(mpmc_queue_t *q, int me, int kind, uint64_t pos)
+{
+    int dead_owner = 0;
+    for (uint32_t i = 0; i < q->max_participants; i++)
+    {
+        if ((int)i == me)
+            continue;
+        int claim_kind;
+        uint64_t start;
+        uint32_t n;
+        if (atomic_load(&mpmc_participant(q, i)->state) == MPMC_FREE || mpmc_read_claim(q, i, &claim_kind, &start, &n))
+            continue;
+        if (claim_kind != kind || pos < start || pos >= start + n)
+            continue;
+        // a failed claim of a dead process may overlap the real owner's one, so keep looking for a living owner
+        if (mpmc_alive(q, i))
+            return 0;
+        dead_owner = 1;
+    }
+    return dead_owner;
+}
+
+// Unblocks the slots at both heads of the queue if their owner died before publishing them.
+// Returns the number of repaired slots.
+int mpmc_repair(mpmc_queue_t *q, int me)
+{
+    int repaired = 0;
+
+    // a producer claimed the slot and died before writing it: publish it as a hole
+    uint64_t pos = atomic_load(&q->dequeue_pos);
+    mpmc_slot_t *slot = mpmc_slot(q, pos);
+    if (atomic_load(&slot->seq) == pos && atomic_load(&q->enqueue_pos) > pos &&
+        mpmc_claimed_by_dead(q, me, MPMC_PUSH, pos))
+    {
+        // take the slot before marking it, if its producer has published it in the meantime the exchange fails
+        uint64_t expected = pos;
+        if (atomic_compare_exchange_strong(&slot->seq, &expected, MPMC_REPAIRING))
+        {
+            slot->skip = 1;
+            atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+            atomic_fetch_add(&q->skipped, 1);
+            repaired++;
+        }
+    }
+
+    // a consumer claimed the slot and died before releasing it: the item is lost, free the slot
+    pos = atomic_load(&q->enqueue_pos);
+    if (pos >= q->capacity)
+    {
+        uint64_t prev = pos - q->capacity;
+        slot = mpmc_slot(q, prev);
+        if (atomic_load(&slot->seq) == prev + 1 && atomic_load(&q->dequeue_pos) > prev &&
+            mpmc_claimed_by_dead(q, me, MPMC_POP, prev))
+        {
+            uint64_t expected = prev + 1;
+            if (atomic_compare_exchange_strong(&slot->seq, &expected, prev + q->capacity))
+            {
+                atomic_fetch_add(&q->skipped, 1);
+                repaired++;
+            }
+        }
+    }
+    return repaired;
+}
+
+void mpmc_backoff(mpmc_queue_t *q, int me, unsigned *spins)
+{
+    (*spins)++;
+    if (*spins < 64)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return;
+    }
+    if (*spins % MPMC_SPINS == 0 && mpmc_repair(q, me) > 0)
+    {
+        *spins = 0;
+        return;
+    }
+    if (*spins < MPMC_SPINS)
+    {
+        sched_yield();
+        return;
+    }
+    struct timespec ts = {0, 50000};
+    nanosleep(&ts, NULL);
+}
+
+// Blocks until all n items are pushed.
+void mpmc_push(mpmc_queue_t *q, int me, const uint64_t *items, uint32_t n)
+{
+    unsigned spins = 0;
+    while (n > 0)
+    {
+        uint32_t k = mpmc_try_push(q, me, items, n);
+        if (k == 0)
+        {
+            mpmc_backoff(q, me, &spins);
+            continue;
+        }
+        items += k;
+        n -= k;
+        spins = 0;
+    }
+}
+
+// Blocks until at least one item is popped. Returns the number of popped items.
+uint32_t mpmc_pop(mpmc_queue_t *q, int me, uint64_t *items, uint32_t max)
+{
+    unsigned spins = 0;
+    for (;;)
+    {
+        uint32_t k = mpmc_try_pop(q, me, items, max);
+        if (k > 0)
+            return k;
+        mpmc_backoff(q, me, &spins);
+    }
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef SOP_SHM_H
+#define SOP_SHM_H
+
+// Memory allocator inside a named shared memory segment.
+//
+// Every process may map the segment at a different address, so objects inside refer to each other by offsets from
+// the start of the segment (shm_off_t, 0 is the null offset) and turn them into pointers with shm_ptr.
+// Small blocks are carved from the segment by a bump pointer and recycled through per-size-class free lists (slabs),
+// larger ones go to a first-fit list. All of it is guarded by a single robust mutex; every update of the lists is
+// a single store, so a process dying inside shm_alloc or shm_free can leak a block but never corrupts the lists.
+//
+// The arena itself stores no application data except for one root offset, the entry point to whatever the
+// programs build inside.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x414e455241504f53ULL  // "SOPARENA"
+#define SHM_VERSION 1
+#define SHM_ALIGN 16
+#define SHM_MIN_CLASS 4  // smallest slab holds 16 bytes
+#define SHM_CLASSES 9    // ... the largest 4096
+#define SHM_NULL 0
+
+typedef uint64_t shm_off_t;
+
+typedef struct shm_block
+{
+    uint64_t size;   // of the payload
+    shm_off_t next;  // next free block while on a free list
+} shm_block_t;
+
+typedef struct shm_arena
+{
+    _Atomic uint64_t magic;  // written last, a segment without it is not initialized yet
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t size;
+    pthread_mutex_t mtx;
+    uint64_t brk;  // everything from here to the end of the segment was never allocated
+    shm_off_t free[SHM_CLASSES];
+    shm_off_t large;
+    _Atomic shm_off_t root;
+} shm_arena_t;
+
+void *shm_ptr(shm_arena_t *a, shm_off_t off) { return off == SHM_NULL ? NULL : (char *)a + off; }
+
+shm_off_t shm_off(shm_arena_t *a, void *ptr) { return ptr == NULL ? SHM_NULL : (shm_off_t)((char *)ptr - (char *)a); }
+
+// The header in front of an allocated block, `off` is never SHM_NULL here.
+shm_block_t *shm_block(shm_arena_t *a, shm_off_t off) { return (shm_block_t *)((char *)a + off) - 1; }
+
+uint64_t shm_round(uint64_t size) { return (size + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1); }
+
+// Size class of a request, SHM_CLASSES for the ones served from the large list.
+int shm_class(uint64_t size)
+{
+    int c = 0;
+    while (c < SHM_CLASSES && size > (1ULL << (SHM_MIN_CLASS + c)))
+        c++;
+    return c;
+}
+
+// Initializes a pshared robust mutex, handy for the objects built inside the arena. Returns 0 or an error number.
+int shm_mutex_init(pthread_mutex_t *mtx)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int err = pthread_mutex_init(mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return err;
+}
+
+int shm_lock(shm_arena_t *a)
+{
+    int err = pthread_mutex_lock(&a->mtx);
+    if (err == EOWNERDEAD)
+        err = pthread_mutex_consistent(&a->mtx);
+    return err;
+}
+
+shm_arena_t *shm_map(int fd, uint64_t size)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return ptr == MAP_FAILED ? NULL : (shm_arena_t *)ptr;
+}
+
+// Creates a new segment of `size` bytes. Returns NULL with errno set (EEXIST if it already exists).
+shm_arena_t *shm_arena_create(const char *name, uint64_t size)
+{
+    uint64_t header = shm_round(sizeof(shm_arena_t));
+    if (size < header + sizeof(shm_block_t) + SHM_ALIGN)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return NULL;
+    shm_arena_t *a = NULL;
+    if (ftruncate(fd, size) == 0)
+        a = shm_map(fd, size);
+    int err = errno;
+    close(fd);
+    if (a == NULL)
+    {
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+
+    // ftruncate zeroed the segment, so all the lists are empty
+    a->version = SHM_VERSION;
+    a->header_size = sizeof(shm_arena_t);
+    a->size = size;
+    a->brk = header;
+    if ((err = shm_mutex_init(&a->mtx)) != 0)
+    {
+        munmap(a, size);
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+    atomic_store(&a->magic, SHM_MAGIC);
+    return a;
+}
+
+// Maps an existing segment, waiting for its creator to finish the initialization.
+// Returns NULL with errno set (ENOENT if it doesn't exist, EPROTO if it isn't an arena of this version).
+shm_arena_t *shm_arena_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    shm_arena_t *a = NULL;
+    int err = EPROTO;
+    // the creator may still be between shm_open and ftruncate
+    for (int tries = 0; tries < 1000; tries++)
+    {
+        if (fstat(fd, &st) < 0)
+        {
+            err = errno;
+            break;
+        }
+        if ((uint64_t)st.st_size >= sizeof(shm_arena_t))
+        {
+            if ((a = shm_map(fd, st.st_size)) == NULL)
+                err = errno;
+            break;
+        }
+        sched_yield();
+    }
+    close(fd);
+    if (a == NULL)
+    {
+        errno = err;
+        return NULL;
+    }
+    for (int tries = 0; tries < 1000 && atomic_load(&a->magic) != SHM_MAGIC; tries++)
+        sched_yield();
+    if (atomic_load(&a->magic) != SHM_MAGIC || a->version != SHM_VERSION || a->header_size != sizeof(shm_arena_t) ||
+        a->size != (uint64_t)st.st_size)
+    {
+        munmap(a, st.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+    return a;
+}
+
+// Attaches to the segment or creates it if it doesn't exist yet. *created tells which one happened.
+shm_arena_t *shm_arena_open(const char *name, uint64_t size, int *created)
+{
+    for (;;)
+    {
+        shm_arena_t *a = shm_arena_create(name, size);
+        if (a != NULL || errno != EEXIST)
+        {
+            *created = a != NULL;
+            return a;
+        }
+        a = shm_arena_attach(name);
+        if (a != NULL || errno != ENOENT)
+        {
+            *created = 0;
+            return a;
+        }
+        // it was unlinked in the meantime, try again
+    }
+}
+
+int shm_arena_detach(shm_arena_t *a) { return munmap(a, a->size); }
+
+// Allocates `size` bytes aligned to SHM_ALIGN. Returns the offset of the block or SHM_NULL with errno set.
+shm_off_t shm_alloc(shm_arena_t *a, uint64_t size)
+{
+    int c = shm_class(size);
+    size = c < SHM_CLASSES ? 1ULL << (SHM_MIN_CLASS + c) : shm_round(size);
+    int err;
+    if ((err = shm_lock(a)) != 0)
+    {
+        errno = err;
+        return SHM_NULL;
+    }
+
+    shm_off_t off = SHM_NULL;
+    if (c < SHM_CLASSES && a->free[c] != SHM_NULL)
+    {
+        off = a->free[c];
+        a->free[c] = shm_block(a, off)->next;
+    }
+    else if (c == SHM_CLASSES)
+    {
+        for (shm_off_t *prev = &a->large; *prev != SHM_NULL; prev = &shm_block(a, *prev)->next)
+            if (shm_block(a, *prev)->size >= size)
+            {
+                off = *prev;
+                *prev = shm_block(a, off)->next;
+                break;
+            }
+    }
+    if (off == SHM_NULL && a->brk + sizeof(shm_block_t) + size <= a->size)
+    {
+        off = a->brk + sizeof(shm_block_t);
+        shm_block(a, off)->size = size;
+        a->brk = off + size;
+    }
+    pthread_mutex_unlock(&a->mtx);
+
+    if (off == SHM_NULL)
+    {
+        errno = ENOMEM;
+        return SHM_NULL;
+    }
+    shm_block(a, off)->next = SHM_NULL;
+    memset(shm_ptr(a, off), 0, shm_block(a, off)->size);
+    return off;
+}
+
+// Returns the block to its free list. Returns 0 on success, -1 with errno set otherwise.
+int shm_free(shm_arena_t *a, shm_off_t off)
+{
+    if (off == SHM_NULL)
+        return 0;
+    shm_block_t *b = shm_block(a, off);
+    int c = shm_class(b->size);
+    int err;
+    if ((err = shm_lock(a)) != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    shm_off_t *list = c < SHM_CLASSES ? &a->free[c] : &a->large;
+    b->next = *list;
+    *list = off;
+    pthread_mutex_unlock(&a->mtx);
+    return 0;
+}
+
+// Offset of the application's entry object, SHM_NULL until set.
+shm_off_t shm_root(shm_arena_t *a) { return atomic_load(&a->root); }
+
+void shm_set_root(shm_arena_t *a, shm_off_t off) { atomic_store(&a->root, off); }
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef SOP_SLAB_H
+#define SOP_SLAB_H
+
+// Variable-size message storage in shared memory.
+//
+// The slab is a byte ring: a producer reserves a region, writes the payload in place and passes the returned
+// descriptor to the consumer (e.g. through sop_mpmc.h), which reads the payload in place and releases it.
+// Regions may be released in any order; the space is reclaimed once everything before it is released as well.
+// Reservations are taken under a short critical section, payloads are never copied.
+//
+// Regions reserved or popped by a process which then dies are never released.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SLAB_ALIGN 8
+
+enum
+{
+    SLAB_USED,
+    SLAB_RELEASED
+};
+
+typedef struct slab_record
+{
+    uint32_t len;
+    _Atomic uint32_t state;
+} slab_record_t;
+
+typedef struct slab
+{
+    pthread_mutex_t mtx;
+    pthread_cond_t space;
+    uint64_t size;
+    uint64_t head;
+    uint64_t tail;
+    _Alignas(SLAB_ALIGN) unsigned char data[];
+} slab_t;
+
+uint64_t slab_round(uint64_t len) { return (len + SLAB_ALIGN - 1) & ~(uint64_t)(SLAB_ALIGN - 1); }
+
+// Size of the shared memory needed for a slab with `size` bytes of payload space.
+size_t slab_size(uint64_t size) { return sizeof(slab_t) + slab_round(size); }
+
+// Largest payload which fits into the slab.
+uint32_t slab_max_len(slab_t *s) { return s->size - sizeof(slab_record_t); }
+
+slab_record_t *slab_record(slab_t *s, uint64_t desc) { return (slab_record_t *)(s->data + desc); }
+
+// Returns 0 on success, -1 with errno set otherwise.
+int slab_init(slab_t *s, uint64_t size)
+{
+    size = slab_round(size);
+    if (size < 2 * sizeof(slab_record_t))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(s, 0, sizeof(slab_t));
+    s->size = size;
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+
+    int err;
+    if ((err = pthread_mutex_init(&s->mtx, &mutex_attr)) == 0)
+        err = pthread_cond_init(&s->space, &cond_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_destroy(&cond_attr);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void slab_destroy(slab_t *s)
+{
+    pthread_cond_destroy(&s->space);
+    pthread_mutex_destroy(&s->mtx);
+}
+
+int slab_lock(slab_t *s)
+{
+    int err = pthread_mutex_lock(&s->mtx);
+    if (err == EOWNERDEAD)
+        err = pthread_mutex_consistent(&s->mtx);
+    return err;
+}
+
+// Reserves `len` bytes, blocking while the slab is full if `wait` is set. Stores the descriptor of the region in *desc
+// and returns a pointer to the payload, or NULL with errno set (EAGAIN if the slab is full and `wait` is not set).
+void *slab_reserve_wait(slab_t *s, uint32_t len, uint64_t *desc, int wait)
+{
+    if (len > slab_max_len(s))
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    uint64_t need = sizeof(slab_record_t) + slab_round(len);
+
+    int err;
+    if ((err = slab_lock(s)) != 0)
+    {
+        errno = err;
+        return NULL;
+    }
+    for (;;)
+    {
+        // an empty ring starts over at the beginning of the segment, so a record up to slab_max_len always fits
+        if (s->head == s->tail && s->head % s->size != 0)
+            s->head = s->tail = s->head + s->size - s->head % s->size;
+        uint64_t off = s->head % s->size;
+        // a record never wraps around, the rest of the ring is skipped instead
+        uint64_t pad = (off + need > s->size) ? s->size - off : 0;
+        if (s->head + pad + need - s->tail <= s->size)
+        {
+            if (pad > 0)
+            {
+                slab_record_t *skip = slab_record(s, off);
+                skip->len = pad - sizeof(slab_record_t);
+                atomic_store(&skip->state, SLAB_RELEASED);
+                s->head += pad;
+                off = 0;
+            }
+            slab_record_t *rec = slab_record(s, off);
+            rec->len = len;
+            atomic_store(&rec->state, SLAB_USED);
+            s->head += need;
+            pthread_mutex_unlock(&s->mtx);
+            *desc = off;
+            return rec + 1;
+        }
+        if (!wait)
+        {
+            pthread_mutex_unlock(&s->mtx);
+            errno = EAGAIN;
+            return NULL;
+        }
+        err = pthread_cond_wait(&s->space, &s->mtx);
+        if (err == EOWNERDEAD)
+            err = pthread_mutex_consistent(&s->mtx);
+        if (err != 0)
+        {
+            pthread_mutex_unlock(&s->mtx);
+            errno = err;
+            return NULL;
+        }
+    }
+}
+
+// A producer must publish everything it has already reserved before blocking here, otherwise the consumers might
+// never release enough space.
+void *slab_reserve(slab_t *s, uint32_t len, uint64_t *desc) { return slab_reserve_wait(s, len, desc, 1); }
+
+void *slab_try_reserve(slab_t *s, uint32_t len, uint64_t *desc) { return slab_reserve_wait(s, len, desc, 0); }
+
+// Returns the payload behind a descriptor and stores its length in *len.
+void *slab_payload(slab_t *s, uint64_t desc, uint32_t *len)
+{
+    slab_record_t *rec = slab_record(s, desc);
+    *len = rec->len;
+    return rec + 1;
+}
+
+// Returns 0 on success, -1 with errno set otherwise.
+int slab_release(slab_t *s, uint64_t desc)
+{
+    atomic_store_explicit(&slab_record(s, desc)->state, SLAB_RELEASED, memory_order_release);
+
+    int err;
+    if ((err = slab_lock(s)) != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    uint64_t old_tail = s->tail;
+    while (s->tail < s->head)
+    {
+        slab_record_t *rec = slab_record(s, s->tail % s->size);
+        if (atomic_load_explicit(&rec->state, memory_order_acquire) != SLAB_RELEASED)
+            break;
+        s->tail += sizeof(slab_record_t) + slab_round(rec->len);
+    }
+    if (s->tail != old_tail)
+        pthread_cond_broadcast(&s->space);
+    pthread_mutex_unlock(&s->mtx);
+    return 0;
+}
+
+#endif
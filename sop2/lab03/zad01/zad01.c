@@ -1,6 +1,9 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,21 +17,85 @@
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 #define ALPHA 26
 #define FILENAME "./file.txt"
+#define CACHE_LINE 64
+#define DEFAULT_CHUNK_KB 1024
+#define DEATH_PERCENT 5
+#define MAX_WORD 64
+#define DEFAULT_TOP 10
+#define DEFAULT_TABLE_SLOTS (1 << 20)
+#define MAX_WORKERS (1 << 16)
 
-volatile sig_atomic_t last_signal;
+enum
+{
+    CHUNK_PENDING = -1,
+    CHUNK_DONE = -2,
+    // a chunk in progress holds the slot number of its worker,
+    // a chunk being merged into the shared word table holds CHUNK_MERGING + slot
+    CHUNK_MERGING = MAX_WORKERS
+};
 
-void signal_handler(int signo) { last_signal = signo; }
+enum
+{
+    WORD_EMPTY = 0,
+    WORD_READY = 1,
+    WORD_ABANDONED = 2
+    // an entry being filled in holds -(slot + 1) of its writer
+};
 
-void set_handler(void (*f)(int), int signo)
+typedef struct word_entry
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof(struct sigaction));
-    act.sa_handler = f;
-    if (sigaction(signo, &act, NULL) == -1)
-    {
-        ERR("sigaction");
-    }
-}
+    _Atomic int64_t state;
+    uint64_t hash;
+    uint64_t key;  // offset of the word in the key arena
+    uint32_t len;
+    _Atomic uint64_t count;
+} word_entry_t;
+
+// Open-addressing hash table shared by all workers, followed by the arena holding the words.
+// Entries are claimed with a CAS and counted with atomic adds, there is no global lock.
+typedef struct word_table
+{
+    uint64_t mask;
+    uint64_t arena_size;
+    _Alignas(CACHE_LINE) _Atomic uint64_t arena_used;
+    _Alignas(CACHE_LINE) word_entry_t entries[];
+} word_table_t;
+
+typedef struct local_word
+{
+    uint64_t hash;
+    uint64_t count;
+    uint32_t key;
+    uint32_t len;
+} local_word_t;
+
+// private per-chunk counts, merged into the shared table once the chunk is tokenised
+typedef struct local_map
+{
+    local_word_t* words;
+    uint64_t mask;
+    uint64_t used;
+    char* keys;
+    size_t keys_len;
+    size_t keys_cap;
+} local_map_t;
+
+// each chunk keeps its own counts on separate cache lines, so a chunk lost with a dead worker can simply be recounted
+typedef struct chunk
+{
+    _Alignas(CACHE_LINE) _Atomic int state;
+    uint64_t freq[ALPHA];
+} chunk_t;
+
+typedef struct work
+{
+    off_t file_sz;
+    off_t chunk_sz;
+    int n_chunks;
+    word_table_t* table;  // NULL when counting letters
+    _Alignas(CACHE_LINE) _Atomic int cursor;
+    chunk_t chunks[];
+} work_t;
 
 void msleep(int msec)
 {
@@ -41,101 +108,532 @@ void msleep(int msec)
         ERR("nanosleep");
 }
 
-void child_work(int n, int id, int* res)
+// Counts the letters using four histograms, so that repeated letters don't wait on each other's increments.
+void count_letters(const unsigned char* data, size_t len, uint64_t freq[ALPHA])
+{
+    uint64_t hist[4][256];
+    memset(hist, 0, sizeof(hist));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        hist[0][w & 0xff]++;
+        hist[1][(w >> 8) & 0xff]++;
+        hist[2][(w >> 16) & 0xff]++;
+        hist[3][(w >> 24) & 0xff]++;
+        hist[0][(w >> 32) & 0xff]++;
+        hist[1][(w >> 40) & 0xff]++;
+        hist[2][(w >> 48) & 0xff]++;
+        hist[3][w >> 56]++;
+    }
+    for (; i < len; i++)
+        hist[0][data[i]]++;
+    for (int c = 0; c < ALPHA; c++)
+        freq[c] = hist[0]['a' + c] + hist[1]['a' + c] + hist[2]['a' + c] + hist[3]['a' + c];
+}
+
+int is_word_char(unsigned char c) { return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (c >= '0' && c <= '9'); }
+
+uint64_t hash_word(const char* word, uint32_t len)
+{
+    uint64_t h = 14695981039346656037ULL;  // FNV-1a
+    for (uint32_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)word[i]) * 1099511628211ULL;
+    return h;
+}
+
+void local_map_init(local_map_t* map, uint64_t slots)
+{
+    map->mask = slots - 1;
+    map->used = 0;
+    if ((map->words = calloc(slots, sizeof(local_word_t))) == NULL)
+        ERR("calloc");
+    map->keys_len = 0;
+    map->keys_cap = slots * 8;
+    if ((map->keys = malloc(map->keys_cap)) == NULL)
+        ERR("malloc");
+}
+
+void local_map_clear(local_map_t* map)
+{
+    memset(map->words, 0, (map->mask + 1) * sizeof(local_word_t));
+    map->used = 0;
+    map->keys_len = 0;
+}
+
+void local_map_free(local_map_t* map)
+{
+    free(map->words);
+    free(map->keys);
+}
+
+local_word_t* local_map_find(local_map_t* map, const char* word, uint32_t len, uint64_t hash)
+{
+    for (uint64_t i = hash & map->mask;; i = (i + 1) & map->mask)
+    {
+        local_word_t* w = &map->words[i];
+        if (w->count == 0 || (w->hash == hash && w->len == len && memcmp(map->keys + w->key, word, len) == 0))
+            return w;
+    }
+}
+
+void local_map_grow(local_map_t* map)
+{
+    local_map_t bigger = *map;
+    bigger.mask = map->mask * 2 + 1;
+    if ((bigger.words = calloc(bigger.mask + 1, sizeof(local_word_t))) == NULL)
+        ERR("calloc");
+    for (uint64_t i = 0; i <= map->mask; i++)
+    {
+        local_word_t* w = &map->words[i];
+        if (w->count > 0)
+            *local_map_find(&bigger, map->keys + w->key, w->len, w->hash) = *w;
+    }
+    free(map->words);
+    *map = bigger;
+}
+
+void local_map_add(local_map_t* map, const char* word, uint32_t len)
+{
+    uint64_t hash = hash_word(word, len);
+    local_word_t* w = local_map_find(map, word, len, hash);
+    if (w->count > 0)
+    {
+        w->count++;
+        return;
+    }
+    if (map->keys_len + len > map->keys_cap)
+    {
+        map->keys_cap = 2 * map->keys_cap + len;
+        if ((map->keys = realloc(map->keys, map->keys_cap)) == NULL)
+            ERR("realloc");
+    }
+    memcpy(map->keys + map->keys_len, word, len);
+    *w = (local_word_t){.hash = hash, .count = 1, .key = map->keys_len, .len = len};
+    map->keys_len += len;
+    if (++map->used * 2 > map->mask)
+        local_map_grow(map);
+}
+
+// Counts the words starting in data[begin, end). A word cut by `begin` belongs to the previous chunk, a word cut by
+// `end` is read up to `limit`. Words are lowercased and truncated to MAX_WORD characters.
+void count_words(const unsigned char* data, size_t begin, size_t end, size_t limit, local_map_t* map)
+{
+    size_t i = begin;
+    if (begin > 0 && is_word_char(data[begin - 1]))
+    {
+        while (i < end && is_word_char(data[i]))
+            i++;
+    }
+    char word[MAX_WORD];
+    for (;;)
+    {
+        while (i < end && !is_word_char(data[i]))
+            i++;
+        if (i >= end)
+            break;
+        uint32_t len = 0;
+        for (; i < limit && is_word_char(data[i]); i++)
+        {
+            if (len < MAX_WORD)
+                word[len++] = (data[i] >= 'A' && data[i] <= 'Z') ? data[i] | 0x20 : data[i];
+        }
+        local_map_add(map, word, len);
+    }
+}
+
+char* table_arena(word_table_t* table) { return (char*)&table->entries[table->mask + 1]; }
+
+size_t table_size(uint64_t slots, uint64_t arena_size)
+{
+    return sizeof(word_table_t) + slots * sizeof(word_entry_t) + arena_size;
+}
+
+void table_add(word_table_t* table, int slot, local_word_t* w, const char* word)
+{
+    char* arena = table_arena(table);
+    uint64_t i = w->hash & table->mask;
+    for (uint64_t probes = 0; probes <= table->mask; probes++, i = (i + 1) & table->mask)
+    {
+        word_entry_t* e = &table->entries[i];
+        int64_t state = atomic_load_explicit(&e->state, memory_order_acquire);
+        if (state == WORD_EMPTY)
+        {
+            if (atomic_compare_exchange_strong(&e->state, &state, -(slot + 1)))
+            {
+                uint64_t key = atomic_fetch_add(&table->arena_used, w->len);
+                if (key + w->len > table->arena_size)
+                {
+                    errno = ENOMEM;
+                    ERR("table_add");
+                }
+                memcpy(arena + key, word, w->len);
+                e->hash = w->hash;
+                e->key = key;
+                e->len = w->len;
+                atomic_fetch_add_explicit(&e->count, w->count, memory_order_relaxed);
+                atomic_store_explicit(&e->state, WORD_READY, memory_order_release);
+                return;
+            }
+        }
+        // the parent abandons entries of dead writers
+        while (state < 0)
+        {
+            sched_yield();
+            state = atomic_load_explicit(&e->state, memory_order_acquire);
+        }
+        if (state == WORD_READY && e->hash == w->hash && e->len == w->len && memcmp(arena + e->key, word, w->len) == 0)
+        {
+            atomic_fetch_add_explicit(&e->count, w->count, memory_order_relaxed);
+            return;
+        }
+    }
+    errno = ENOSPC;
+    ERR("table_add");
+}
+
+void merge_words(word_table_t* table, int slot, local_map_t* map)
+{
+    for (uint64_t i = 0; i <= map->mask; i++)
+    {
+        local_word_t* w = &map->words[i];
+        if (w->count > 0)
+            table_add(table, slot, w, map->keys + w->key);
+    }
+}
+
+// Returns the number of entries left half-written by a dead worker.
+int abandon_entries(word_table_t* table, int slot)
+{
+    int abandoned = 0;
+    for (uint64_t i = 0; i <= table->mask; i++)
+    {
+        int64_t expected = -(slot + 1);
+        if (atomic_compare_exchange_strong(&table->entries[i].state, &expected, WORD_ABANDONED))
+            abandoned++;
+    }
+    return abandoned;
+}
+
+int claim_chunk(work_t* work, int slot, int i)
+{
+    int expected = CHUNK_PENDING;
+    return atomic_compare_exchange_strong(&work->chunks[i].state, &expected, slot);
+}
+
+// Returns the index of the next chunk to count or -1 if there is nothing left.
+int next_chunk(work_t* work, int slot)
+{
+    int i;
+    while ((i = atomic_fetch_add(&work->cursor, 1)) < work->n_chunks)
+    {
+        if (claim_chunk(work, slot, i))
+            return i;
+    }
+    // chunks of dead workers are put back by the parent
+    for (i = 0; i < work->n_chunks; i++)
+    {
+        if (atomic_load(&work->chunks[i].state) == CHUNK_PENDING && claim_chunk(work, slot, i))
+            return i;
+    }
+    return -1;
+}
+
+void count_chunk_words(int fd, work_t* work, int slot, int i, local_map_t* map)
+{
+    // the neighbouring pages are mapped as well to fix up the words cut by the chunk boundaries
+    long page = sysconf(_SC_PAGESIZE);
+    off_t offset = (off_t)i * work->chunk_sz;
+    off_t map_offset = (offset > 0) ? offset - page : 0;
+    off_t end = offset + work->chunk_sz, limit = end + page;
+    if (end > work->file_sz)
+        end = work->file_sz;
+    if (limit > work->file_sz)
+        limit = work->file_sz;
+    unsigned char* content;
+    if ((content = (unsigned char*)mmap(NULL, limit - map_offset, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd,
+                                        map_offset)) == MAP_FAILED)
+        ERR("mmap");
+    if (madvise(content, limit - map_offset, MADV_SEQUENTIAL) != 0)
+        ERR("madvise");
+    local_map_clear(map);
+    count_words(content, offset - map_offset, end - map_offset, limit - map_offset, map);
+    if (munmap(content, limit - map_offset) != 0)
+        ERR("munmap");
+
+    // from now on a crash cannot be undone by recounting the chunk
+    atomic_store(&work->chunks[i].state, CHUNK_MERGING + slot);
+    merge_words(work->table, slot, map);
+    atomic_store_explicit(&work->chunks[i].state, CHUNK_DONE, memory_order_release);
+}
+
+void count_chunk(int fd, work_t* work, int i)
+{
+    off_t offset = (off_t)i * work->chunk_sz;
+    size_t len = (offset + work->chunk_sz > work->file_sz) ? work->file_sz - offset : work->chunk_sz;
+    unsigned char* content;
+    if ((content = (unsigned char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, offset)) == MAP_FAILED)
+        ERR("mmap");
+    if (madvise(content, len, MADV_SEQUENTIAL) != 0)
+        ERR("madvise");
+    uint64_t freq[ALPHA];
+    count_letters(content, len, freq);
+    if (munmap(content, len) != 0)
+        ERR("munmap");
+
+    // publish once, not on every letter
+    memcpy(work->chunks[i].freq, freq, sizeof(freq));
+    atomic_store_explicit(&work->chunks[i].state, CHUNK_DONE, memory_order_release);
+}
+
+void child_work(int slot, work_t* work)
 {
     msleep(1000);
     int pid = getpid();
     srand(pid);
-    if (rand() % 100 <= 5)
-        abort();
+    // a doomed worker dies in the middle of one of its chunks
+    int doomed = rand() % 100 < DEATH_PERCENT;
+    int chunks_to_death = rand() % 4;
 
+    local_map_t map;
+    if (work->table != NULL)
+        local_map_init(&map, 1 << 12);
     int fd = open(FILENAME, O_RDONLY);
     if (fd == -1)
         ERR("open");
-    struct stat stat;
-    fstat(fd, &stat);
-    int file_sz = stat.st_size;
-
-    char* content;
-    if ((content = (char*)mmap(NULL, file_sz, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    int i;
+    while ((i = next_chunk(work, slot)) != -1)
     {
-        ERR("mmap");
+        if (doomed && chunks_to_death-- == 0)
+            abort();
+        if (work->table != NULL)
+            count_chunk_words(fd, work, slot, i, &map);
+        else
+            count_chunk(fd, work, i);
     }
     if (close(fd) != 0)
         ERR("close");
+    if (work->table != NULL)
+        local_map_free(&map);
+}
 
-    int len = file_sz / n, offset = len * id;
-    if (id == n - 1)
-        len = file_sz - offset;
-    for (int i = offset; i < offset + len; i++)
+pid_t spawn_worker(int slot, work_t* work, size_t work_sz)
+{
+    pid_t pid;
+    if ((pid = fork()) == -1)
+        ERR("fork");
+    if (pid == 0)
     {
-        if (content[i] >= 'a' && content[i] <= 'z')
-            res[id * ALPHA + content[i] - 'a']++;
+        child_work(slot, work);
+        if (munmap(work, work_sz) != 0)
+            ERR("munmap");
+        exit(EXIT_SUCCESS);
     }
-    if (munmap(content, len) != 0)
-        ERR("munmap");
+    return pid;
 }
 
-void make_children(int n, int* res)
+int find_slot(int n, pid_t* pids, pid_t pid)
 {
     for (int i = 0; i < n; i++)
     {
-        int pid;
-        if ((pid = fork()) == -1)
-            ERR("fork");
-        if (pid == 0)
-        {
-            child_work(n, i, res);
-            exit(EXIT_SUCCESS);
-        }
+        if (pids[i] == pid)
+            return i;
+    }
+    return -1;
+}
+
+// Returns the number of chunks taken away from the worker. A chunk the worker died merging can't be recounted
+// without counting some of its words twice, so it is given up and counted in *tainted.
+int requeue_chunks(work_t* work, int slot, int* tainted)
+{
+    int requeued = 0;
+    for (int i = 0; i < work->n_chunks; i++)
+    {
+        int expected = slot;
+        if (atomic_compare_exchange_strong(&work->chunks[i].state, &expected, CHUNK_PENDING))
+            requeued++;
+        expected = CHUNK_MERGING + slot;
+        if (atomic_compare_exchange_strong(&work->chunks[i].state, &expected, CHUNK_DONE))
+            (*tainted)++;
     }
+    if (work->table != NULL)
+        abandon_entries(work->table, slot);
+    return requeued;
 }
 
-void parent_work(int n, int* res)
+int chunks_left(work_t* work)
 {
+    int left = 0;
+    for (int i = 0; i < work->n_chunks; i++)
+    {
+        if (atomic_load(&work->chunks[i].state) != CHUNK_DONE)
+            left++;
+    }
+    return left;
+}
+
+int compare_counts(const void* a, const void* b)
+{
+    uint64_t x = atomic_load(&(*(word_entry_t**)a)->count), y = atomic_load(&(*(word_entry_t**)b)->count);
+    return (x < y) - (x > y);
+}
+
+void print_top_words(word_table_t* table, int top)
+{
+    word_entry_t** words = malloc((table->mask + 1) * sizeof(word_entry_t*));
+    if (words == NULL)
+        ERR("malloc");
+    uint64_t n = 0;
+    for (uint64_t i = 0; i <= table->mask; i++)
+    {
+        if (atomic_load(&table->entries[i].state) == WORD_READY)
+            words[n++] = &table->entries[i];
+    }
+    qsort(words, n, sizeof(word_entry_t*), compare_counts);
+    printf("%lu distinct words, top %d:\n", n, top);
+    for (uint64_t i = 0; i < n && i < (uint64_t)top; i++)
+        printf("%lu %.*s\n", atomic_load(&words[i]->count), (int)words[i]->len, table_arena(table) + words[i]->key);
+    free(words);
+}
+
+void parent_work(int n, work_t* work, size_t work_sz, int top)
+{
+    pid_t* pids = malloc(n * sizeof(pid_t));
+    if (pids == NULL)
+        ERR("malloc");
+    for (int i = 0; i < n; i++)
+        pids[i] = spawn_worker(i, work, work_sz);
+
+    int deaths = 0, requeued = 0, tainted = 0, respawns_left = 4 * n;
     for (;;)
     {
-        if (wait(NULL) <= 0)
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid <= 0)
         {
-            // if (last_signal == SIGCHLD)
-            // {
-            //     printf("Computation failed\n");
-            //     return;
-            // }
             if (errno == ECHILD)
                 break;
-            ERR("wait");
+            if (errno == EINTR)
+                continue;
+            ERR("waitpid");
         }
+        int slot = find_slot(n, pids, pid);
+        pids[slot] = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+            continue;
+
+        deaths++;
+        requeued += requeue_chunks(work, slot, &tainted);
+        // the survivors may have already run out of chunks, so the requeued ones get a fresh worker
+        if (chunks_left(work) > 0 && respawns_left-- > 0)
+            pids[slot] = spawn_worker(slot, work, work_sz);
     }
-    int freq[ALPHA];
-    memset(freq, 0, ALPHA * sizeof(int));
-    for (int i = 0; i < n; i++)
+    free(pids);
+
+    int missing = chunks_left(work);
+    printf("%d workers died, %d chunks re-dispatched\n", deaths, requeued);
+    if (missing > 0)
+    {
+        printf("Computation failed, %d of %d chunks are missing\n", missing, work->n_chunks);
+        return;
+    }
+    if (work->table != NULL)
+    {
+        if (tainted > 0)
+            printf("%d chunks were merged only partially, their words may be undercounted\n", tainted);
+        print_top_words(work->table, top);
+        return;
+    }
+
+    uint64_t freq[ALPHA] = {0};
+    for (int i = 0; i < work->n_chunks; i++)
     {
         for (int j = 0; j < ALPHA; j++)
         {
-            freq[j] += res[i * ALPHA + j];
+            freq[j] += work->chunks[i].freq[j];
         }
     }
     printf("Results:\n");
     for (char c = 'a'; c <= 'z'; c++)
-        printf("%c: %d\n", c, freq[c - 'a']);
+        printf("%c: %lu\n", c, freq[c - 'a']);
+}
+
+void usage(char* name)
+{
+    fprintf(stderr, "USAGE: %s [-w top [-t slots]] n [chunk]\n", name);
+    fprintf(stderr, "n - number of worker processes\n");
+    fprintf(stderr, "chunk - size of one unit of work in KiB (default: %d)\n", DEFAULT_CHUNK_KB);
+    fprintf(stderr, "-w - count words instead of letters and print the `top` most frequent ones\n");
+    fprintf(stderr, "-t - capacity of the shared word table, a power of two (default: %d)\n", DEFAULT_TABLE_SLOTS);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv)
 {
-    if (argc < 2)
-        ERR("usage");
-    int n = atoi(argv[1]);
+    int top = 0, c;
+    uint64_t slots = DEFAULT_TABLE_SLOTS;
+    while ((c = getopt(argc, argv, "w:t:")) != -1)
+    {
+        switch (c)
+        {
+            case 'w':
+                top = atoi(optarg);
+                if (top <= 0)
+                    usage(argv[0]);
+                break;
+            case 't':
+                slots = strtoull(optarg, NULL, 10);
+                if (slots == 0 || (slots & (slots - 1)) != 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2)
+        usage(argv[0]);
+    int n = atoi(argv[optind]);
+    off_t chunk_sz = (off_t)(argc - optind == 2 ? atoi(argv[optind + 1]) : DEFAULT_CHUNK_KB) * 1024;
+    if (n <= 0 || n >= MAX_WORKERS || chunk_sz <= 0 || chunk_sz % sysconf(_SC_PAGESIZE) != 0)
+        usage(argv[0]);
+
+    int fd = open(FILENAME, O_RDONLY);
+    if (fd == -1)
+        ERR("open");
+    struct stat stat;
+    if (fstat(fd, &stat) != 0)
+        ERR("fstat");
+    if (close(fd) != 0)
+        ERR("close");
+    int n_chunks = (stat.st_size + chunk_sz - 1) / chunk_sz;
 
-    int* res;
-    if ((res = (int*)mmap(NULL, n * ALPHA * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
-        MAP_FAILED)
+    work_t* work;
+    size_t work_sz = sizeof(work_t) + n_chunks * sizeof(chunk_t);
+    if ((work = (work_t*)mmap(NULL, work_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
         ERR("mmap");
-    set_handler(signal_handler, SIGCHLD);
-    make_children(n, res);
-    parent_work(n, res);
+    work->file_sz = stat.st_size;
+    work->chunk_sz = chunk_sz;
+    work->n_chunks = n_chunks;
+    for (int i = 0; i < n_chunks; i++)
+        atomic_init(&work->chunks[i].state, CHUNK_PENDING);
 
-    if (munmap(res, n * sizeof(int)) != 0)
+    // distinct words can't take more space than the whole file
+    uint64_t arena_size = stat.st_size + MAX_WORD;
+    if (top > 0)
+    {
+        if ((work->table = (word_table_t*)mmap(NULL, table_size(slots, arena_size), PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED)
+            ERR("mmap");
+        work->table->mask = slots - 1;
+        work->table->arena_size = arena_size;
+    }
+
+    parent_work(n, work, work_sz, top);
+
+    if (work->table != NULL && munmap(work->table, table_size(slots, arena_size)) != 0)
+        ERR("munmap");
+    if (munmap(work, work_sz) != 0)
         ERR("munmap");
 
     return EXIT_SUCCESS;
@@ -11,12 +11,61 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../../../sop_rand.h"
+#include "../sop_lease.h"
+#include "../sop_shm.h"
+
 #define ERR(source) \
     (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), kill(0, SIGKILL), exit(EXIT_FAILURE))
 #define NAME_LEN 32
-#define SHM_SIZE 4096
+#define ARENA_SIZE (1 << 16)
+#define DEFAULT_BATCHES 3
+#define POINTS_CHUNK 512
+#define CACHE_LINE 64
+#define SEGMENT_MAGIC 0x53475449324f5053ULL  // "SOP2ITGS"
+#define SEGMENT_VERSION 3
+#define MAX_UNITS 1024
+#define LEASE_MS 5000
+
+/**
+ * Results of one process, linked into a list in the shared arena.
+ */
+typedef struct contribution
+{
+    shm_off_t next;
+    pthread_mutex_t alive;  // robust, held by the process as long as it runs
+    pid_t pid;
+    int finished;  // unset if the process died before it was done
+    uint64_t total;
+    uint64_t total_hit;
+} contribution_t;
+
+/**
+ * Root object of the shared arena. The header lets a late-joining process check that the segment was created
+ * by a compatible version of the program. Bump SEGMENT_VERSION whenever the layout changes.
+ */
+typedef struct segment
+{
+    uint64_t magic;  // written last, a segment without it is not initialized yet
+    uint32_t version;
+    uint32_t size;
+    float a;
+    float b;
+
+    // every batch of every process is a leased unit, any process may compute it
+    shm_off_t leases;
+    shm_off_t unit_points;  // uint32_t[MAX_UNITS], number of points of each unit
+
+    // the mutex and the counters it guards are kept away from the read-only header
+    _Alignas(CACHE_LINE) pthread_mutex_t mtx;
+    shm_off_t contributions;
+    // running totals for progress reports, the result is summed from the committed units
+    _Alignas(CACHE_LINE) uint64_t total;
+    uint64_t total_hit;
+} segment_t;
 
 typedef struct
 {
@@ -47,22 +96,35 @@ double func(double x)
 /**
  * It counts hit points by Monte Carlo method.
  * Use it to process one batch of computation.
+ * @param rng Random number generator of this process
  * @param N Number of points to randomize
  * @param a Lower bound of integration
  * @param b Upper bound of integration
- * @return Number of points which was hit.
+ * @param leases Lease table, the lease is renewed after every chunk of points
+ * @param unit Leased unit
+ * @param token Lease token of the unit
+ * @return Number of points which was hit, -1 if the lease was lost.
  */
-int randomize_points(int N, float a, float b)
+int randomize_points(rng4_t* rng, int N, float a, float b, lease_table_t* leases, uint32_t unit, uint64_t* token)
 {
+    // x coordinates in the first half of the buffer, y coordinates in the second
+    double points[2 * POINTS_CHUNK];
     int hits = 0;
-    for (int i = 0; i < N; ++i)
+    for (int done = 0; done < N; done += POINTS_CHUNK)
     {
-        double rand_x = ((double)rand() / RAND_MAX) * (b - a) + a;
-        double rand_y = ((double)rand() / RAND_MAX);
-        double real_y = func(rand_x);
+        int n = N - done < POINTS_CHUNK ? N - done : POINTS_CHUNK;
+        rng4_fill(rng, points, 2 * POINTS_CHUNK);
+        for (int i = 0; i < n; ++i)
+        {
+            double rand_x = points[i] * (b - a) + a;
+            double rand_y = points[POINTS_CHUNK + i];
+            double real_y = func(rand_x);
 
-        if (rand_y <= real_y)
-            hits++;
+            if (rand_y <= real_y)
+                hits++;
+        }
+        if (lease_renew(leases, unit, token) != 0)
+            return -1;
     }
     return hits;
 }
@@ -102,18 +164,201 @@ int random_death_lock(pthread_mutex_t* mtx)
     return ret;
 }
 
-void process_batch(int n, float a, float b, int* total, int* total_hit)
+/**
+ * Locks the segment mutex. The counters it guards are only the running totals, so nothing has to be repaired when
+ * its previous owner died.
+ * @param seg Shared segment
+ */
+void lock_segment(segment_t* seg)
+{
+    int err;
+    if ((err = pthread_mutex_lock(&seg->mtx)) != 0)
+    {
+        if (err == EOWNERDEAD)
+        {
+            pthread_mutex_consistent(&seg->mtx);
+            printf("someone died\n");
+        }
+        else
+        {
+            ERR("pthread_mutex_lock");
+        }
+    }
+}
+
+/**
+ * Adds the results of one batch to the shared counters.
+ * The batch is computed before the mutex is taken, so the critical section is only a couple of additions.
+ * @param seg Shared segment
+ * @param me Contribution of this process
+ * @param n Number of randomized points in the batch
+ * @param hits Number of hit points in the batch
+ */
+void publish_batch(segment_t* seg, contribution_t* me, int n, int hits)
+{
+    lock_segment(seg);
+    seg->total += n;
+    seg->total_hit += hits;
+    me->total += n;
+    me->total_hit += hits;
+    uint64_t total = seg->total, total_hit = seg->total_hit;
+    pthread_mutex_unlock(&seg->mtx);
+    printf("Batch processed: total: %lu, total_hit: %lu\n", total, total_hit);
+}
+
+/**
+ * Creates the root segment of a fresh arena or checks that an existing one has the expected layout.
+ * Must be called with the segment semaphore held.
+ * @param arena Shared arena
+ * @param a Lower bound of integration, used only when the segment is created
+ * @param b Upper bound of integration, used only when the segment is created
+ * @return The segment, NULL if the arena was created by an incompatible version.
+ */
+segment_t* attach_segment(shm_arena_t* arena, float a, float b)
 {
-    *total += n;
-    *total_hit += randomize_points(n, a, b);
+    segment_t* seg = (segment_t*)shm_ptr(arena, shm_root(arena));
+    if (seg != NULL)
+    {
+        if (seg->magic != SEGMENT_MAGIC || seg->version != SEGMENT_VERSION || seg->size != sizeof(segment_t))
+        {
+            fprintf(stderr, "segment has layout version %u (%u bytes), expected %u (%zu bytes)\n", seg->version,
+                    seg->size, SEGMENT_VERSION, sizeof(segment_t));
+            return NULL;
+        }
+        return seg;
+    }
+
+    if ((seg = (segment_t*)shm_ptr(arena, shm_alloc(arena, sizeof(segment_t)))) == NULL)
+        ERR("shm_alloc");
+    seg->version = SEGMENT_VERSION;
+    seg->size = sizeof(segment_t);
+    seg->a = a;
+    seg->b = b;
+    lease_table_t* leases;
+    if ((leases = (lease_table_t*)shm_ptr(arena, shm_alloc(arena, lease_size(MAX_UNITS)))) == NULL)
+        ERR("shm_alloc");
+    lease_init(leases, MAX_UNITS, LEASE_MS);
+    seg->leases = shm_off(arena, leases);
+    if ((seg->unit_points = shm_alloc(arena, MAX_UNITS * sizeof(uint32_t))) == SHM_NULL)
+        ERR("shm_alloc");
+    if ((errno = shm_mutex_init(&seg->mtx)) != 0)
+        ERR("mutex_init");
+    seg->magic = SEGMENT_MAGIC;
+    shm_set_root(arena, shm_off(arena, seg));
+    return seg;
+}
+
+/**
+ * Adds a contribution record of this process and its batches to the segment.
+ * Must be called with the segment semaphore held.
+ * @param arena Shared arena
+ * @param seg Shared segment
+ * @param n Number of points in a batch
+ * @param batches Number of batches
+ * @return Contribution of this process, NULL if there is no room for the batches.
+ */
+contribution_t* join_segment(shm_arena_t* arena, segment_t* seg, int n, int batches)
+{
+    lease_table_t* leases = shm_ptr(arena, seg->leases);
+    uint32_t* unit_points = shm_ptr(arena, seg->unit_points);
+    // units are only added under the semaphore, so nobody else can take these indices
+    uint32_t first = atomic_load(&leases->count);
+    if ((uint32_t)batches > MAX_UNITS - first)
+    {
+        fprintf(stderr, "the job already has %u batches, at most %d are allowed\n", first, MAX_UNITS);
+        return NULL;
+    }
+    for (int i = 0; i < batches; i++)
+        unit_points[first + i] = n;
+    lease_add(leases, batches);
+
+    contribution_t* me;
+    if ((me = (contribution_t*)shm_ptr(arena, shm_alloc(arena, sizeof(contribution_t)))) == NULL)
+        ERR("shm_alloc");
+    me->pid = getpid();
+    if ((errno = shm_mutex_init(&me->alive)) != 0)
+        ERR("mutex_init");
+    if ((errno = pthread_mutex_lock(&me->alive)) != 0)
+        ERR("pthread_mutex_lock");
+    lock_segment(seg);
+    me->next = seg->contributions;
+    seg->contributions = shm_off(arena, me);
+    pthread_mutex_unlock(&seg->mtx);
+    return me;
+}
+
+/**
+ * Checks whether any other process working on the segment is still alive.
+ * Must be called with the segment semaphore held, so that nobody joins in the meantime.
+ * @param arena Shared arena
+ * @param seg Shared segment
+ * @param me Contribution of this process
+ * @return 1 if this is the last process.
+ */
+int last_alive(shm_arena_t* arena, segment_t* seg, contribution_t* me)
+{
+    int last = 1;
+    lock_segment(seg);
+    for (contribution_t* c = shm_ptr(arena, seg->contributions); c != NULL; c = shm_ptr(arena, c->next))
+    {
+        if (c == me || c->finished)
+            continue;
+        int err = pthread_mutex_trylock(&c->alive);
+        if (err == EBUSY)
+        {
+            last = 0;
+            continue;
+        }
+        // the process died holding its alive mutex
+        if (err == EOWNERDEAD)
+            pthread_mutex_consistent(&c->alive);
+        pthread_mutex_unlock(&c->alive);
+    }
+    pthread_mutex_unlock(&seg->mtx);
+    return last;
+}
+
+/**
+ * Sums the points and hits of all the committed units.
+ * @return Number of units which are not committed.
+ */
+int sum_units(shm_arena_t* arena, segment_t* seg, uint64_t* total, uint64_t* total_hit)
+{
+    lease_table_t* leases = shm_ptr(arena, seg->leases);
+    uint32_t* unit_points = shm_ptr(arena, seg->unit_points);
+    uint32_t count = atomic_load(&leases->count);
+    int missing = 0;
+    *total = *total_hit = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t hits;
+        if (!lease_result(leases, i, &hits))
+        {
+            missing++;
+            continue;
+        }
+        *total += unit_points[i];
+        *total_hit += hits;
+    }
+    return missing;
+}
+
+void print_contributions(shm_arena_t* arena, segment_t* seg)
+{
+    for (contribution_t* c = shm_ptr(arena, seg->contributions); c != NULL; c = shm_ptr(arena, c->next))
+        printf("PID %d%s: total: %lu, total_hit: %lu\n", c->pid, c->finished ? "" : " (died)", c->total,
+               c->total_hit);
 }
 
 void usage(char* argv[])
 {
-    printf("%s a b N - calculating integral with multiple processes\n", argv[0]);
+    printf("%s a b N [B] - calculating integral with multiple processes\n", argv[0]);
     printf("a - Start of segment for integral (default: -1)\n");
     printf("b - End of segment for integral (default: 1)\n");
     printf("N - Size of batch to calculate before reporting to shared memory (default: 1000)\n");
+    printf("B - Number of batches added to the job by this process (default: %d)\n", DEFAULT_BATCHES);
+    printf("Every process computes any batch of the job until all of them are done.\n");
+    printf("Batches of killed processes are taken over after %d ms.\n", LEASE_MS);
     exit(EXIT_FAILURE);
 }
 
@@ -122,8 +367,16 @@ int main(int argc, char* argv[])
     if (argc < 4)
         usage(argv);
     int n = atoi(argv[3]);
+    int batches = (argc > 4) ? atoi(argv[4]) : DEFAULT_BATCHES;
+    if (n <= 0 || batches <= 0)
+        usage(argv);
     float a = atof(argv[1]), b = atof(argv[2]);
     srand(time(NULL));
+    // processes started in the same second must not draw the same points
+    rng_t base;
+    rng_seed(&base, ((uint64_t)time(NULL) << 32) ^ getpid());
+    rng4_t rng;
+    rng4_init(&rng, &base);
 
     sigh_args_t sigh_args = {.running = 1, .mutex = PTHREAD_MUTEX_INITIALIZER};
     sigemptyset(&sigh_args.new_mask);
@@ -136,65 +389,56 @@ int main(int argc, char* argv[])
     if (pthread_detach(sigh_thread) != 0)
         ERR("pthread_detach");
 
-    int shm_fd;
-    char *shm_name = "shm_zad02", *sem_name = "/sem_zad02";
-    if ((shm_fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666)) == -1)
-        ERR("shm_open");
+    char *arena_name = "/zad02_arena", *sem_name = "/sem_zad02";
     sem_t* sem = sem_open(sem_name, O_CREAT, 0666, 1);
     if (sem_wait(sem) != 0)
         ERR("sem_wait");
-    char* shm_ptr;
-    if ((shm_ptr = (char*)mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0)) == MAP_FAILED)
-        ERR("mmap");
-    if (ftruncate(shm_fd, SHM_SIZE) != 0)
-        ERR("ftruncate");
-    pthread_mutex_t* mtx = (pthread_mutex_t*)shm_ptr;
-    int* cnt_active = (int*)(shm_ptr + sizeof(pthread_mutex_t));
-    int* total = (int*)(cnt_active + sizeof(int));
-    int* total_hit = (int*)(total + sizeof(int));
-
-    float* saved_a = (float*)(total_hit + sizeof(int));
-    float* saved_b = (float*)(saved_a + sizeof(float));
-    if (*saved_a != 0)
-        a = *saved_a;
-    if (*saved_b != 0)
-        b = *saved_b;
-    if (*cnt_active == 0)
+    int created;
+    shm_arena_t* arena;
+    if ((arena = shm_arena_open(arena_name, ARENA_SIZE, &created)) == NULL)
+        ERR("shm_arena_open");
+    segment_t* seg;
+    if ((seg = attach_segment(arena, a, b)) == NULL)
+    {
+        sem_post(sem);
+        exit(EXIT_FAILURE);
+    }
+    a = seg->a;
+    b = seg->b;
+    contribution_t* me;
+    if ((me = join_segment(arena, seg, n, batches)) == NULL)
     {
-        pthread_mutexattr_t mtx_attr;
-        pthread_mutexattr_init(&mtx_attr);
-        pthread_mutexattr_setpshared(&mtx_attr, PTHREAD_PROCESS_SHARED);
-        pthread_mutexattr_setrobust(&mtx_attr, PTHREAD_MUTEX_ROBUST);
-        pthread_mutex_init(mtx, &mtx_attr);
-        if (pthread_mutexattr_destroy(&mtx_attr) != 0)
-            ERR("mutexattr_destroy");
+        sem_post(sem);
+        exit(EXIT_FAILURE);
     }
-    (*cnt_active)++;
     if (sem_post(sem) != 0)
         ERR("sem_post");
-    if (sem_close(sem) != 0)
-        ERR("sem_close");
 
-    for (int i = 0; i < 3; i++)
+    lease_table_t* leases = shm_ptr(arena, seg->leases);
+    uint32_t* unit_points = shm_ptr(arena, seg->unit_points);
+    for (;;)
     {
-        int err;
-        if ((err = pthread_mutex_lock(mtx)) != 0)
+        uint64_t token;
+        int64_t unit = lease_claim(leases, &token);
+        if (unit == LEASE_ALL_DONE)
+            break;
+        if (unit == LEASE_ALL_BUSY)
+        {
+            // the remaining batches are computed by others, wait in case one of them dies
+            struct timespec ts = {0, 100 * 1000000};
+            nanosleep(&ts, NULL);
+        }
+        else
         {
-            if (err == EOWNERDEAD)
-            {
-                pthread_mutex_consistent(mtx);
-                (*cnt_active)--;
-                printf("someone died\n");
-            }
+            // the expensive part runs in parallel with the other processes
+            int points = unit_points[unit];
+            int hits = randomize_points(&rng, points, a, b, leases, unit, &token);
+            if (hits < 0 || lease_commit(leases, unit, token, hits) != 0)
+                printf("Batch %ld was taken over by another process\n", unit);
             else
-            {
-                ERR("pthread_mutex_lock");
-            }
+                publish_batch(seg, me, points, hits);
+            // random_death_lock(&seg->mtx);
         }
-        process_batch(n, a, b, total, total_hit);
-        printf("Batch processed: total: %d, total_hit: %d\n", *total, *total_hit);
-        pthread_mutex_unlock(mtx);
-        // random_death_lock(mtx);
 
         pthread_mutex_lock(&sigh_args.mutex);
         if (sigh_args.running == 0)
@@ -206,20 +450,32 @@ int main(int argc, char* argv[])
         pthread_mutex_unlock(&sigh_args.mutex);
     }
 
-    (*cnt_active)--;
-    if (*cnt_active == 0)
+    lock_segment(seg);
+    me->finished = 1;
+    pthread_mutex_unlock(&seg->mtx);
+    pthread_mutex_unlock(&me->alive);
+    if (sem_wait(sem) != 0)
+        ERR("sem_wait");
+    if (last_alive(arena, seg, me))
     {
-        printf("Last one, result: %4f, destroying...\n", summarize_calculations(*total, *total_hit, a, b));
-        if (pthread_mutex_destroy(mtx) != 0)
+        uint64_t total, total_hit;
+        int missing = sum_units(arena, seg, &total, &total_hit);
+        print_contributions(arena, seg);
+        if (missing > 0)
+            printf("%d batches were not computed\n", missing);
+        printf("Last one, result: %4f, destroying...\n", summarize_calculations(total, total_hit, a, b));
+        if (pthread_mutex_destroy(&seg->mtx) != 0)
             ERR("mutex_destroy");
-        if (munmap(shm_ptr, SHM_SIZE) != 0)
-            ERR("munmap");
-        if (shm_unlink(shm_name) != 0)
+        if (shm_unlink(arena_name) != 0)
             ERR("shm_unlink");
         if (sem_unlink(sem_name) != 0)
             ERR("sem_unlink");
     }
-    if (munmap(shm_ptr, SHM_SIZE) != 0)
+    if (sem_post(sem) != 0)
+        ERR("sem_post");
+    if (sem_close(sem) != 0)
+        ERR("sem_close");
+    if (shm_arena_detach(arena) != 0)
         ERR("munmap");
     if (pthread_mutex_destroy(&sigh_args.mutex) != 0)
         ERR("mutex_destroy");
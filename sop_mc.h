@@ -0,0 +1,88 @@
+#ifndef SOP_MC_H
+#define SOP_MC_H
+
+// Monte Carlo estimation of pi on top of sop_rand.h.
+//
+// A point (x, y) from the unit square hits the quarter circle when x * x + y * y <= 1, so no sqrt is needed. With AVX2
+// the points are generated and tested four at a time without ever leaving the registers.
+//
+// Every point is a Bernoulli trial with p = pi / 4, so after n points with h hits the estimate 4 * h / n has standard
+// error 4 * sqrt(p * (1 - p) / n). Programs can stop once it drops below the precision they need.
+
+#include <math.h>
+#include <stdint.h>
+
+#include "sop_rand.h"
+
+// two-sided 95% quantile of the normal distribution
+#define MC_Z95 1.959964
+#define MC_CHUNK 512
+
+RNG_HOT uint64_t mc_pi_hits_scalar(rng4_t *r, uint64_t n)
+{
+    // the same order of numbers as the AVX2 kernel: a step of x coordinates, then a step of y coordinates
+    double buf[2 * MC_CHUNK];
+    uint64_t hits = 0;
+    while (n > 0)
+    {
+        uint64_t points = n < MC_CHUNK ? n : MC_CHUNK;
+        uint64_t steps = (points + RNG_LANES - 1) / RNG_LANES;
+        rng4_fill_scalar(r, buf, 2 * steps * RNG_LANES);
+        for (uint64_t i = 0; i < points; i += RNG_LANES)
+        {
+            double *step = buf + 2 * i;
+            for (uint64_t l = 0; l < RNG_LANES && i + l < points; l++)
+                hits += step[l] * step[l] + step[RNG_LANES + l] * step[RNG_LANES + l] <= 1.0;
+        }
+        n -= points;
+    }
+    return hits;
+}
+
+#ifdef RNG_X86
+__attribute__((target("avx2,popcnt"))) RNG_HOT uint64_t mc_pi_hits_avx2(rng4_t *r, uint64_t n)
+{
+    __m256i s[4];
+    for (int w = 0; w < 4; w++)
+        s[w] = _mm256_loadu_si256((__m256i *)r->s[w]);
+    const __m256d one = _mm256_set1_pd(1.0);
+    uint64_t hits = 0;
+    for (uint64_t i = 0; i < n; i += RNG_LANES)
+    {
+        __m256d x = rng4_step_avx2(s);
+        __m256d y = rng4_step_avx2(s);
+        __m256d d = _mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y));
+        unsigned mask = _mm256_movemask_pd(_mm256_cmp_pd(d, one, _CMP_LE_OQ));
+        // lanes past n in the last step don't count
+        if (n - i < RNG_LANES)
+            mask &= (1u << (n - i)) - 1;
+        hits += __builtin_popcount(mask);
+    }
+    for (int w = 0; w < 4; w++)
+        _mm256_storeu_si256((__m256i *)r->s[w], s[w]);
+    return hits;
+}
+#endif
+
+// Draws n points and returns how many of them hit the quarter circle.
+uint64_t mc_pi_hits(rng4_t *r, uint64_t n)
+{
+#ifdef RNG_X86
+    if (__builtin_cpu_supports("avx2"))
+        return mc_pi_hits_avx2(r, n);
+#endif
+    return mc_pi_hits_scalar(r, n);
+}
+
+double mc_pi(uint64_t hits, uint64_t n) { return n > 0 ? 4.0 * hits / n : 0.0; }
+
+// Standard error of mc_pi(hits, n).
+double mc_pi_stderr(uint64_t hits, uint64_t n)
+{
+    if (n == 0)
+        return INFINITY;
+    double p = (double)hits / n;
+    return 4.0 * sqrt(p * (1.0 - p) / n);
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef SOP_RAND_H
+#define SOP_RAND_H
+
+// Per-worker pseudo-random number generator for the Monte Carlo programs.
+//
+// xoshiro256** (Blackman, Vigna) keeps its whole state in the worker, so nothing is shared between threads the way
+// the hidden state of rand() is. Independent streams are obtained with rng_jump, which advances a generator by 2^128
+// steps: seed one generator and hand out its jumped copies to the workers.
+//
+// rng4_t runs four streams side by side and fills whole arrays of doubles at once, using AVX2 when the CPU has it.
+// The scalar fallback produces exactly the same numbers.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RNG_X86 1
+#endif
+
+#define RNG_LANES 4
+// the batch kernels are the hot loop of every program using them, so they are optimized even in -O0 debug builds
+#define RNG_HOT __attribute__((optimize("O2")))
+
+typedef struct rng
+{
+    uint64_t s[4];
+} rng_t;
+
+// state word w of lane l is s[w][l], so that one state word of all lanes fits into a single AVX2 register
+typedef struct rng4
+{
+    uint64_t s[4][RNG_LANES];
+} rng4_t;
+
+static inline uint64_t rng_rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+uint64_t rng_splitmix(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Any seed is fine, the state is expanded with splitmix64 so it is never all zeros in practice.
+void rng_seed(rng_t *r, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+        r->s[i] = rng_splitmix(&seed);
+}
+
+uint64_t rng_next(rng_t *r)
+{
+    uint64_t *s = r->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+// Advances the generator by 2^128 steps.
+void rng_jump(rng_t *r)
+{
+    static const uint64_t jump[] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL,
+                                    0x39abdc4529b1661cULL};
+    uint64_t s[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4; i++)
+        for (int b = 0; b < 64; b++)
+        {
+            if (jump[i] & (1ULL << b))
+                for (int w = 0; w < 4; w++)
+                    s[w] ^= r->s[w];
+            rng_next(r);
+        }
+    memcpy(r->s, s, sizeof(s));
+}
+
+// Uniform double in [0, 1).
+double rng_double(rng_t *r) { return (rng_next(r) >> 11) * 0x1.0p-53; }
+
+// Takes the next four streams of `base` (which is advanced past them) as the lanes of `r`.
+void rng4_init(rng4_t *r, rng_t *base)
+{
+    for (int l = 0; l < RNG_LANES; l++)
+    {
+        for (int w = 0; w < 4; w++)
+            r->s[w][l] = base->s[w];
+        rng_jump(base);
+    }
+}
+
+// 52 random bits become the mantissa of a double in [1, 2), which is then shifted to [0, 1) - no int to double
+// conversion needed.
+static inline double rng_bits_to_double(uint64_t x)
+{
+    uint64_t bits = (x >> 12) | 0x3ff0000000000000ULL;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d - 1.0;
+}
+
+RNG_HOT void rng4_fill_scalar(rng4_t *r, double *out, size_t n)
+{
+    uint64_t(*s)[RNG_LANES] = r->s;
+    for (size_t i = 0; i < n; i += RNG_LANES)
+        for (int l = 0; l < RNG_LANES; l++)
+        {
+            uint64_t result = rng_rotl(s[1][l] * 5, 7) * 9;
+            uint64_t t = s[1][l] << 17;
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s[1][l];
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= t;
+            s[3][l] = rng_rotl(s[3][l], 45);
+            if (i + l < n)
+                out[i + l] = rng_bits_to_double(result);
+        }
+}
+
+#ifdef RNG_X86
+#define RNG_ROTL256(x, k) _mm256_or_si256(_mm256_slli_epi64((x), (k)), _mm256_srli_epi64((x), 64 - (k)))
+
+// Advances all four lanes by one step and returns their next numbers as doubles in [0, 1).
+__attribute__((target("avx2"), always_inline)) RNG_HOT static inline __m256d rng4_step_avx2(__m256i s[4])
+{
+    // there is no 64-bit multiply in AVX2, but x * 5 = (x << 2) + x and x * 9 = (x << 3) + x
+    __m256i x = _mm256_add_epi64(_mm256_slli_epi64(s[1], 2), s[1]);
+    x = RNG_ROTL256(x, 7);
+    x = _mm256_add_epi64(_mm256_slli_epi64(x, 3), x);
+    __m256i t = _mm256_slli_epi64(s[1], 17);
+    s[2] = _mm256_xor_si256(s[2], s[0]);
+    s[3] = _mm256_xor_si256(s[3], s[1]);
+    s[1] = _mm256_xor_si256(s[1], s[2]);
+    s[0] = _mm256_xor_si256(s[0], s[3]);
+    s[2] = _mm256_xor_si256(s[2], t);
+    s[3] = RNG_ROTL256(s[3], 45);
+    __m256i bits = _mm256_or_si256(_mm256_srli_epi64(x, 12), _mm256_set1_epi64x(0x3ff0000000000000LL));
+    return _mm256_sub_pd(_mm256_castsi256_pd(bits), _mm256_set1_pd(1.0));
+}
+
+__attribute__((target("avx2"))) RNG_HOT void rng4_fill_avx2(rng4_t *r, double *out, size_t n)
+{
+    __m256i s[4];
+    for (int w = 0; w < 4; w++)
+        s[w] = _mm256_loadu_si256((__m256i *)r->s[w]);
+    for (size_t i = 0; i < n; i += RNG_LANES)
+    {
+        __m256d d = rng4_step_avx2(s);
+        if (n - i >= RNG_LANES)
+            _mm256_storeu_pd(out + i, d);
+        else
+        {
+            double tail[RNG_LANES];
+            _mm256_storeu_pd(tail, d);
+            memcpy(out + i, tail, (n - i) * sizeof(double));
+        }
+    }
+    for (int w = 0; w < 4; w++)
+        _mm256_storeu_si256((__m256i *)r->s[w], s[w]);
+}
+#endif
+
+// Fills out[0..n) with uniform doubles in [0, 1). Lane l produces out[l], out[l + 4], ...
+// If n is not a multiple of 4, the numbers of the last step which don't fit are dropped.
+void rng4_fill(rng4_t *r, double *out, size_t n)
+{
+#ifdef RNG_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+        rng4_fill_avx2(r, out, n);
+        return;
+    }
+#endif
+    rng4_fill_scalar(r, out, n);
+}
+
+#endif